@@ -35,6 +35,7 @@
 #include <algorithm>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <cctype>
 #include <cstdio>
 #include <cerrno>
@@ -44,10 +45,11 @@
 #include <err.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <dirent.h>
 #include <sys/vfs.h>
 #include <sys/stat.h>
 
+#include "conf_common.hh"
+
 #ifndef BINFMTFS_MAGIC
 /* from linux/magic.h */
 #define BINFMTFS_MAGIC 0x42494e4d
@@ -73,12 +75,13 @@ static void usage(FILE *f) {
 "\n"
 "      -u  Unregister instead of registering.\n"
 "      -p  Print the contents of config files to standard output.\n"
+"      -d  Print the changes to be made instead of making them.\n"
 "      -h  Print this message and exit.\n",
         __progname
     );
 }
 
-static void binfmt_check_mounted(bool print_only) {
+static void binfmt_check_mounted(bool print_only, bool dry_run) {
     if (print_only) {
         return;
     }
@@ -93,6 +96,10 @@ static void binfmt_check_mounted(bool print_only) {
         err(1, "binfmt_misc has a wrong type");
     }
     /* check if it's writable */
+    if (dry_run) {
+        binfmt_fd = fd;
+        return;
+    }
     char proc[256];
     std::snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
     if (access(proc, W_OK) < 0) {
@@ -112,110 +119,395 @@ static bool poke_bfmt(char const *path, char const *value, std::size_t vlen) {
     return ret;
 }
 
-static bool load_rule(char *rule, std::size_t rlen) {
-    /* get the name */
-    char *rulename = rule + 1;
-    char delim[2] = {rule[0], '\0'};
-    /* length of name in rule */
-    auto rulelen = std::strcspn(rulename, delim);
+enum {
+    BINFMT_FLAG_P = 1 << 0,
+    BINFMT_FLAG_O = 1 << 1,
+    BINFMT_FLAG_C = 1 << 2,
+    BINFMT_FLAG_F = 1 << 3,
+};
+
+/* a registration in a canonical form that can be compared between the
+ * rules in config files and what the kernel reports for existing entries
+ */
+struct binfmt_entry {
+    std::string name;
+    std::string interp;
+    /* raw masked bytes for magic, or the extension without the dot */
+    std::string magic;
+    std::string mask;
+    /* the original rule, for registering */
+    std::string rule;
+    unsigned long offset = 0;
+    unsigned int flags = 0;
+    char type = '\0';
+    bool enabled = true;
+    /* whether it was understood well enough to be compared */
+    bool valid = false;
+
+    bool same(binfmt_entry const &o) const {
+        if (
+            !valid || !o.valid || (type != o.type) || (enabled != o.enabled) ||
+            (flags != o.flags) || (interp != o.interp) || (magic != o.magic)
+        ) {
+            return false;
+        }
+        if (type == 'E') {
+            return true;
+        }
+        return (offset == o.offset) && (mask == o.mask);
+    }
+
+    /* the kernel may or may not store the magic masked */
+    void apply_mask() {
+        if (mask.empty() || (mask.size() != magic.size())) {
+            return;
+        }
+        for (std::size_t i = 0; i < magic.size(); ++i) {
+            magic[i] &= mask[i];
+        }
+    }
+};
+
+static unsigned int parse_flags(std::string_view sv) {
+    unsigned int ret = 0;
+    for (auto c: sv) {
+        switch (c) {
+            case 'P': ret |= BINFMT_FLAG_P; break;
+            case 'O': ret |= BINFMT_FLAG_O; break;
+            /* credentials imply open-binary */
+            case 'C': ret |= BINFMT_FLAG_C | BINFMT_FLAG_O; break;
+            case 'F': ret |= BINFMT_FLAG_F; break;
+            default: break;
+        }
+    }
+    return ret;
+}
+
+static int hex_digit(char c) {
+    if ((c >= '0') && (c <= '9')) {
+        return c - '0';
+    } else if ((c >= 'a') && (c <= 'f')) {
+        return c - 'a' + 10;
+    } else if ((c >= 'A') && (c <= 'F')) {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* only hex escapes are processed, like the kernel does */
+static std::string unescape_hex(std::string_view sv) {
+    std::string ret;
+    for (std::size_t i = 0; i < sv.size(); ++i) {
+        int d1;
+        if (
+            (sv[i] != '\\') || (i + 2 >= sv.size()) ||
+            (sv[i + 1] != 'x') || ((d1 = hex_digit(sv[i + 2])) < 0)
+        ) {
+            ret.push_back(sv[i]);
+            continue;
+        }
+        i += 2;
+        int d2 = (i + 1 < sv.size()) ? hex_digit(sv[i + 1]) : -1;
+        if (d2 >= 0) {
+            d1 = d1 * 16 + d2;
+            ++i;
+        }
+        ret.push_back(char(d1));
+    }
+    return ret;
+}
+
+static bool decode_hex(std::string_view sv, std::string &out) {
+    out.clear();
+    if (sv.size() % 2) {
+        return false;
+    }
+    for (std::size_t i = 0; i < sv.size(); i += 2) {
+        int d1 = hex_digit(sv[i]), d2 = hex_digit(sv[i + 1]);
+        if ((d1 < 0) || (d2 < 0)) {
+            return false;
+        }
+        out.push_back(char(d1 * 16 + d2));
+    }
+    return true;
+}
+
+/* :name:type:offset:magic:mask:interpreter:flags */
+static bool parse_rule(std::string_view rule, binfmt_entry &ent) {
+    ent.rule = rule;
+    char delim = rule[0];
+    std::string_view fields[7];
+    std::size_t nfields = 0;
+    auto rest = rule.substr(1);
+    while (nfields < 7) {
+        auto sep = rest.find(delim);
+        fields[nfields++] = rest.substr(0, sep);
+        if (sep == std::string_view::npos) {
+            break;
+        }
+        rest = rest.substr(sep + 1);
+    }
     /* validate */
-    if (!rulelen) {
-        warnx("invalid binfmt '%s'", rule);
+    auto &name = fields[0];
+    if (name.empty()) {
+        warnx("invalid binfmt '%s'", ent.rule.data());
         return false;
     }
     if (
-        !std::strncmp(rulename, "register", rulelen) ||
-        !std::strncmp(rulename, "status", rulelen) ||
-        !std::strncmp(rulename, "..", rulelen) ||
-        !std::strncmp(rulename, ".", rulelen) ||
-        std::memchr(rulename, '/', rulelen)
+        (name == "register") || (name == "status") || (name == "..") ||
+        (name == ".") || (name.find('/') != std::string_view::npos)
     ) {
-        warnx("invalid rule name in '%s'", rule);
+        warnx("invalid rule name in '%s'", ent.rule.data());
         return false;
     }
-    /* deregister old rule */
-    rulename[rulelen] = '\0';
-    if (!poke_bfmt(rulename, "-1", 2) && (errno != ENOENT)) {
-        warn("failed to unregister rule '%s'", rulename);
+    ent.name = name;
+    /* not something we can compare; the kernel will complain if needed */
+    if ((nfields < 7) || (fields[1].size() != 1)) {
+        return true;
+    }
+    ent.type = fields[1][0];
+    ent.interp = fields[5];
+    ent.flags = parse_flags(fields[6]);
+    if (ent.type == 'E') {
+        ent.magic = fields[3];
+        ent.valid = true;
+        return true;
+    } else if (ent.type != 'M') {
+        return true;
+    }
+    if (!fields[2].empty()) {
+        std::string off{fields[2]};
+        char *end = nullptr;
+        ent.offset = std::strtoul(off.data(), &end, 10);
+        if (*end) {
+            return true;
+        }
+    }
+    ent.magic = unescape_hex(fields[3]);
+    ent.mask = unescape_hex(fields[4]);
+    ent.apply_mask();
+    ent.valid = true;
+    return true;
+}
+
+/* parse what the kernel reports in /proc/sys/fs/binfmt_misc/<name> */
+static bool read_entry(char const *name, binfmt_entry &ent) {
+    char buf[8192];
+    int fd = openat(binfmt_fd, name, O_RDONLY);
+    if (fd < 0) {
         return false;
     }
-    rulename[rulelen] = rule[0];
-    /* register new rule */
-    if (!poke_bfmt("register", rule, rlen)) {
-        warn("failed to register rule '%s'", rule);
+    auto rd = read(fd, buf, sizeof(buf));
+    close(fd);
+    if ((rd <= 0) || (std::size_t(rd) >= sizeof(buf))) {
+        return false;
+    }
+    ent.name = name;
+    ent.valid = true;
+    auto data = std::string_view{buf, std::size_t(rd)};
+    while (!data.empty()) {
+        auto nl = data.find('\n');
+        auto line = data.substr(0, nl);
+        data = (nl == std::string_view::npos) ? "" : data.substr(nl + 1);
+        auto sp = line.find(' ');
+        auto key = line.substr(0, sp);
+        auto val = (sp == std::string_view::npos) ? "" : line.substr(sp + 1);
+        if (key == "enabled") {
+            ent.enabled = true;
+        } else if (key == "disabled") {
+            ent.enabled = false;
+        } else if (key == "interpreter") {
+            ent.interp = val;
+        } else if (key == "flags:") {
+            ent.flags = parse_flags(val);
+        } else if (key == "offset") {
+            ent.offset = std::strtoul(std::string{val}.data(), nullptr, 10);
+        } else if (key == "magic") {
+            ent.type = 'M';
+            if (!decode_hex(val, ent.magic)) {
+                ent.valid = false;
+            }
+        } else if (key == "mask") {
+            if (!decode_hex(val, ent.mask)) {
+                ent.valid = false;
+            }
+        } else if (key == "extension") {
+            ent.type = 'E';
+            ent.magic = val.substr(val.empty() ? 0 : 1);
+        }
+    }
+    ent.apply_mask();
+    return true;
+}
+
+static void read_entries(std::unordered_map<std::string, binfmt_entry> &ents) {
+    int dfd = openat(binfmt_fd, ".", O_RDONLY | O_DIRECTORY);
+    if (dfd < 0) {
+        warn("failed to open binfmt_misc");
+        return;
+    }
+    std::vector<std::string> names;
+    conf_scandir(dfd, [&names](char const *dn, unsigned char) {
+        if (std::strcmp(dn, "register") && std::strcmp(dn, "status")) {
+            names.emplace_back(dn);
+        }
+    });
+    close(dfd);
+    for (auto &n: names) {
+        binfmt_entry ent;
+        if (read_entry(n.data(), ent)) {
+            ents.emplace(n, std::move(ent));
+        }
+    }
+}
+
+/* with the F flag, the kernel holds on to the interpreter it opened at
+ * registration, so if it was replaced since, the entry has to be redone
+ */
+static bool interp_replaced(binfmt_entry const &ent) {
+    if (!(ent.flags & BINFMT_FLAG_F)) {
+        return false;
+    }
+    struct stat est, ist;
+    if (
+        (fstatat(binfmt_fd, ent.name.data(), &est, 0) < 0) ||
+        (stat(ent.interp.data(), &ist) < 0)
+    ) {
+        return true;
+    }
+    if (ist.st_ctim.tv_sec != est.st_mtim.tv_sec) {
+        return (ist.st_ctim.tv_sec > est.st_mtim.tv_sec);
+    }
+    return (ist.st_ctim.tv_nsec >= est.st_mtim.tv_nsec);
+}
+
+static bool unload_rule(char const *name) {
+    if (!poke_bfmt(name, "-1", 2) && (errno != ENOENT)) {
+        warn("failed to unregister rule '%s'", name);
+        return false;
+    }
+    return true;
+}
+
+static bool load_rule(binfmt_entry const &ent) {
+    if (!poke_bfmt("register", ent.rule.data(), ent.rule.size())) {
+        warn("failed to register rule '%s'", ent.rule.data());
         return false;
     }
     /* success! */
     return true;
 }
 
-static bool load_conf(char const *s, char *&line, std::size_t &len) {
-    FILE *f = std::fopen(s, "rb");
-    if (!f) {
+static bool load_conf(char const *s, std::vector<binfmt_entry> &rules) {
+    conf_reader rd;
+    if (!rd.open(s)) {
         warnx("could not load '%s'", s);
         return false;
     }
     bool fret = true;
-    for (ssize_t nread; (nread = getline(&line, &len, f)) != -1;) {
-        /* strip leading whitespace and ignore comments, empty lines etc */
-        char *cline = line;
-        auto rlen = std::size_t(nread);
-        while (std::isspace(*cline)) {
-            ++cline;
-            --rlen;
-        }
-        if ((*cline == '#') || (*cline == ';') || !*cline) {
-            continue;
-        }
-        /* strip trailing whitespace too once we are sure it's not empty */
-        auto rl = std::strlen(line);
-        while (std::isspace(line[rl - 1])) {
-            line[--rl] = '\0';
-            --rlen;
-        }
+    for (std::string_view sv; rd.next(sv);) {
         /* this should be a registerable binfmt */
-        if (!load_rule(cline, rlen)) {
+        binfmt_entry ent;
+        if (!parse_rule(sv, ent)) {
             fret = false;
+            continue;
+        }
+        /* a later rule of the same name replaces the earlier one */
+        auto it = std::find_if(rules.begin(), rules.end(), [&ent](auto &r) {
+            return (r.name == ent.name);
+        });
+        if (it != rules.end()) {
+            *it = std::move(ent);
+        } else {
+            rules.push_back(std::move(ent));
         }
     }
-    std::fclose(f);
     return fret;
 }
 
-static bool print_conf(char const *s, char *&line, std::size_t &len) {
-    FILE *f = std::fopen(s, "rb");
-    if (!f) {
-        std::printf("# '%s' could not be loaded\n", s);
-        return false;
+/* only touch what differs from the kernel state */
+static bool apply_rules(std::vector<binfmt_entry> const &rules, bool dry) {
+    std::unordered_map<std::string, binfmt_entry> cur;
+    read_entries(cur);
+    bool ret = true;
+    std::vector<binfmt_entry const *> regs;
+    for (auto &r: rules) {
+        auto it = cur.find(r.name);
+        if (it == cur.end()) {
+            regs.push_back(&r);
+            continue;
+        }
+        if (r.same(it->second) && !interp_replaced(it->second)) {
+            continue;
+        }
+        /* changed, drop the old one first */
+        if (dry) {
+            std::printf("- %s\n", r.name.data());
+        } else if (!unload_rule(r.name.data())) {
+            ret = false;
+            continue;
+        }
+        regs.push_back(&r);
     }
-    std::printf("# %s\n", s);
-    ssize_t nread;
-    while ((nread = getline(&line, &len, f)) != -1) {
-        std::printf("%s", line);
-        if (line[nread - 1] != '\n') {
-            /* just in case file is not terminated with newline */
-            std::putchar('\n');
+    /* entries not in the configuration are left alone, as they may have
+     * been registered by something else (e.g. a container runtime)
+     */
+    for (auto *r: regs) {
+        if (dry) {
+            std::printf("+ %s\n", r->rule.data());
+        } else if (!load_rule(*r)) {
+            ret = false;
         }
     }
-    std::fclose(f);
+    return ret;
+}
+
+/* unregister everything, configured or not, like writing -1 to status */
+static bool unload_all(bool dry) {
+    if (!dry) {
+        return poke_bfmt("status", "-1", 2);
+    }
+    std::unordered_map<std::string, binfmt_entry> cur;
+    read_entries(cur);
+    std::vector<std::string const *> names;
+    for (auto &c: cur) {
+        names.push_back(&c.first);
+    }
+    std::sort(names.begin(), names.end(), [](auto a, auto b) {
+        return (*a < *b);
+    });
+    for (auto *n: names) {
+        std::printf("- %s\n", n->data());
+    }
     return true;
 }
 
-static bool process_conf(
-    char const *s, char *&line, std::size_t &len, bool only_print
-) {
-    if (only_print) {
-        return print_conf(s, line, len);
+static bool print_conf(char const *s) {
+    conf_reader rd;
+    if (!rd.open(s)) {
+        std::printf("# '%s' could not be loaded\n", s);
+        return false;
     }
-    return load_conf(s, line, len);
+    std::printf("# %s\n", s);
+    auto sv = rd.data();
+    std::fwrite(sv.data(), 1, sv.size(), stdout);
+    if (!sv.empty() && (sv.back() != '\n')) {
+        /* just in case file is not terminated with newline */
+        std::putchar('\n');
+    }
+    return true;
 }
 
 int main(int argc, char **argv) {
+    bool arg_d = false;
     bool arg_p = false;
     bool arg_u = false;
 
-    for (int c; (c = getopt(argc, argv, "hpu")) >= 0;) {
+    for (int c; (c = getopt(argc, argv, "dhpu")) >= 0;) {
         switch (c) {
+            case 'd':
+                arg_d = true;
+                break;
             case 'h':
                 usage(stdout);
                 return 0;
@@ -238,69 +530,41 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    binfmt_check_mounted(arg_p);
+    binfmt_check_mounted(arg_p, arg_d);
 
     if (arg_u) {
-        if (!poke_bfmt("status", "-1", 2)) {
+        if (!unload_all(arg_d)) {
             err(1, "failed to unregister binfmt entries");
         }
         /* success */
         return 0;
     }
 
-    std::unordered_map<std::string, std::string> got_map;
+    std::vector<conf_file> files;
 
-    for (char const **p = paths; *p; ++p) {
-        DIR *dfd = opendir(*p);
-        if (!dfd) {
-            continue;
-        }
-        struct dirent *dp;
-        while ((dp = readdir(dfd))) {
-            /* must be a regular file */
-            if (dp->d_type != DT_REG) {
-                continue;
-            }
-            /* check if it matches .conf */
-            char const *dn = dp->d_name;
-            auto sl = std::strlen(dn);
-            if ((sl <= 5) || strcmp(dn + sl - 5, ".conf")) {
-                continue;
-            }
-            /* check if already in map */
-            if (got_map.find(dn) != got_map.end()) {
-                continue;
-            }
-            /* otherwise use its full name */
-            std::string fp = *p;
-            fp.push_back('/');
-            fp += dp->d_name;
-            got_map.emplace(dn, std::move(fp));
-        }
-        closedir(dfd);
-    }
+    conf_collect(paths, files);
 
-    std::vector<std::string const *> ord_list;
+    int ret = 0;
 
-    /* construct a sorted vector of names, backed by map memory */
-    for (auto &p: got_map) {
-        ord_list.push_back(&p.first);
+    if (arg_p) {
+        for (auto &c: files) {
+            if (!print_conf(c.path.data())) {
+                ret = 1;
+            }
+        }
+        return ret;
     }
-    std::sort(ord_list.begin(), ord_list.end(), [](auto a, auto b) {
-        return (*a < *b);
-    });
 
-    int ret = 0;
-
-    /* now register or print each conf */
-    char *line = nullptr;
-    std::size_t len = 0;
-    for (auto &c: ord_list) {
-        if (!process_conf(got_map[*c].data(), line, len, arg_p)) {
+    /* collect all the rules and then sync them with the kernel */
+    std::vector<binfmt_entry> rules;
+    for (auto &c: files) {
+        if (!load_conf(c.path.data(), rules)) {
             ret = 1;
         }
     }
-    std::free(line);
+    if (!apply_rules(rules, arg_d)) {
+        ret = 1;
+    }
     close(binfmt_fd);
     return ret;
 }
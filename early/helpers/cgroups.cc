@@ -0,0 +1,432 @@
+/*
+ * Cgroup setup helper
+ *
+ * Mounts the unified cgroup hierarchy, enables all available controllers
+ * at its root and creates the configured cgroups. Each line of a cgroups.d
+ * file names a cgroup relative to the root, followed by initial values of
+ * its attributes:
+ *
+ * system.slice cpu.weight=100 io.weight=100 memory.high=80%
+ *
+ * Memory attributes may be given as a percentage of total memory. The
+ * parents of nested cgroups are created as needed, and all controllers
+ * available to a configured cgroup are enabled in each of its parents.
+ * Only a failure to mount the hierarchy is fatal.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 q66 <q66@chimera-linux.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdio>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include "conf_common.hh"
+
+#ifndef CGROUP2_SUPER_MAGIC
+/* from linux/magic.h */
+#define CGROUP2_SUPER_MAGIC 0x63677270
+#endif
+
+#define CG_PATH "/sys/fs/cgroup"
+
+/* search paths for conf files */
+static char const *paths[] = {
+    "/etc/cgroups.d",
+    "/run/cgroups.d",
+    "/usr/local/lib/cgroups.d",
+    "/usr/lib/cgroups.d",
+    nullptr
+};
+
+struct cg_attr {
+    std::string name;
+    std::string value;
+};
+
+struct cg_entry {
+    std::string path;
+    std::vector<cg_attr> attrs;
+};
+
+static void usage(FILE *f) {
+    extern char const *__progname;
+    std::fprintf(f, "Usage: %s [OPTION]...\n"
+"\n"
+"Set up the unified cgroup hierarchy.\n"
+"\n"
+"      -n  Do not create the configured cgroups.\n"
+"      -h  Print this message and exit.\n",
+        __progname
+    );
+}
+
+static bool write_attr(int dfd, char const *name, std::string_view val) {
+    int fd = openat(dfd, name, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    auto ret = write(fd, val.data(), val.size());
+    int serr = errno;
+    close(fd);
+    errno = serr;
+    return (ret == ssize_t(val.size()));
+}
+
+static bool read_attr(int dfd, char const *name, std::string &out) {
+    int fd = openat(dfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    char buf[512];
+    out.clear();
+    for (;;) {
+        auto ret = read(fd, buf, sizeof(buf));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return false;
+        } else if (ret == 0) {
+            break;
+        }
+        out.append(buf, ret);
+    }
+    close(fd);
+    while (!out.empty() && (out.back() == '\n')) {
+        out.pop_back();
+    }
+    return true;
+}
+
+/* enable everything the cgroup has available for its children; it is
+ * done in a single write, which the kernel applies all or nothing, so
+ * if a controller is refused (e.g. cpu while there are realtime tasks
+ * around) fall back to enabling them one by one
+ */
+static void enable_controllers(int dfd) {
+    std::string conts;
+    if (!read_attr(dfd, "cgroup.controllers", conts) || conts.empty()) {
+        return;
+    }
+    std::string req;
+    std::vector<std::string> names;
+    for (std::size_t i = 0;;) {
+        auto sp = conts.find(' ', i);
+        auto nm = conts.substr(i, sp - i);
+        if (!nm.empty()) {
+            req += (req.empty() ? "+" : " +");
+            req += nm;
+            names.push_back(std::move(nm));
+        }
+        if (sp == std::string::npos) {
+            break;
+        }
+        i = sp + 1;
+    }
+    if (write_attr(dfd, "cgroup.subtree_control", req)) {
+        return;
+    }
+    for (auto &nm: names) {
+        /* if some fail, that's ok */
+        auto one = "+" + nm;
+        write_attr(dfd, "cgroup.subtree_control", one);
+    }
+}
+
+static bool do_mount() {
+    struct statfs sfs;
+    if (!statfs(CG_PATH, &sfs) && (sfs.f_type == CGROUP2_SUPER_MAGIC)) {
+        /* already mounted */
+        return true;
+    }
+    if (mkdir(CG_PATH, 0755) && (errno != EEXIST)) {
+        warn("could not create '%s'", CG_PATH);
+        return false;
+    }
+    struct stat st, pst;
+    if (!stat(CG_PATH, &st) && !stat(CG_PATH "/..", &pst)) {
+        if (st.st_dev != pst.st_dev) {
+            /* something else is mounted there, leave it be */
+            return true;
+        }
+    }
+    if (mount(
+        "cgroup2", CG_PATH, "cgroup2",
+        MS_NOSUID | MS_NOEXEC | MS_NODEV | MS_SILENT, "nsdelegate"
+    )) {
+        warn("could not mount '%s'", CG_PATH);
+        return false;
+    }
+    return true;
+}
+
+static unsigned long long mem_total() {
+    unsigned long long ret = 0;
+    FILE *f = std::fopen("/proc/meminfo", "rb");
+    if (!f) {
+        return 0;
+    }
+    char buf[256];
+    while (std::fgets(buf, sizeof(buf), f)) {
+        if (std::sscanf(buf, "MemTotal: %llu kB", &ret) == 1) {
+            ret *= 1024;
+            break;
+        }
+    }
+    std::fclose(f);
+    return ret;
+}
+
+/* memory values may be relative to total memory */
+static bool resolve_value(cg_attr &attr) {
+    if (
+        attr.name.compare(0, 7, "memory.") ||
+        attr.value.empty() || (attr.value.back() != '%')
+    ) {
+        return true;
+    }
+    char *end = nullptr;
+    auto pct = std::strtoul(attr.value.data(), &end, 10);
+    if ((end != &attr.value.back()) || (pct > 100)) {
+        return false;
+    }
+    auto total = mem_total();
+    if (!total) {
+        return false;
+    }
+    attr.value = std::to_string(total / 100 * pct);
+    return true;
+}
+
+static bool valid_path(std::string_view p) {
+    if (p.empty() || (p.front() == '/') || (p.back() == '/')) {
+        return false;
+    }
+    /* no empty, hidden or relative components */
+    for (std::size_t i = 0; i < p.size(); ++i) {
+        if ((p[i] == '/') && (p[i + 1] == '/')) {
+            return false;
+        }
+        if (((i == 0) || (p[i - 1] == '/')) && (p[i] == '.')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool load_conf(char const *s, std::vector<cg_entry> &ents) {
+    conf_reader rd;
+    if (!rd.open(s)) {
+        warnx("could not load '%s'", s);
+        return false;
+    }
+    bool fret = true;
+    for (std::string_view sv; rd.next(sv);) {
+        auto sp = sv.find_first_of(" \t");
+        auto path = sv.substr(0, sp);
+        if (!valid_path(path)) {
+            warnx(
+                "%s: invalid cgroup '%.*s'", s, int(path.size()), path.data()
+            );
+            fret = false;
+            continue;
+        }
+        auto it = std::find_if(ents.begin(), ents.end(), [&path](auto &e) {
+            return (e.path == path);
+        });
+        if (it == ents.end()) {
+            ents.push_back(cg_entry{std::string{path}, {}});
+            it = ents.end() - 1;
+        }
+        /* attributes of the same cgroup are merged, later ones win */
+        while (sp != std::string_view::npos) {
+            auto b = sv.find_first_not_of(" \t", sp);
+            if (b == std::string_view::npos) {
+                break;
+            }
+            sp = sv.find_first_of(" \t", b);
+            auto tok = sv.substr(b, sp - b);
+            auto eq = tok.find('=');
+            if (
+                (eq == std::string_view::npos) || !eq ||
+                (tok.find('/') != std::string_view::npos)
+            ) {
+                warnx(
+                    "%s: invalid attribute '%.*s'",
+                    s, int(tok.size()), tok.data()
+                );
+                fret = false;
+                continue;
+            }
+            cg_attr attr{
+                std::string{tok.substr(0, eq)},
+                std::string{tok.substr(eq + 1)}
+            };
+            auto ait = std::find_if(
+                it->attrs.begin(), it->attrs.end(), [&attr](auto &a) {
+                    return (a.name == attr.name);
+                }
+            );
+            if (ait != it->attrs.end()) {
+                *ait = std::move(attr);
+            } else {
+                it->attrs.push_back(std::move(attr));
+            }
+        }
+    }
+    return fret;
+}
+
+static bool setup_cgroup(int rootfd, cg_entry &ent) {
+    /* walk down the path, creating what is missing */
+    int dfd = dup(rootfd);
+    if (dfd < 0) {
+        warn("dup");
+        return false;
+    }
+    for (std::size_t i = 0; i < ent.path.size();) {
+        auto sl = ent.path.find('/', i);
+        auto comp = ent.path.substr(i, sl - i);
+        enable_controllers(dfd);
+        if (mkdirat(dfd, comp.data(), 0755) && (errno != EEXIST)) {
+            warn("could not create cgroup '%s'", ent.path.data());
+            close(dfd);
+            return false;
+        }
+        int nfd = openat(dfd, comp.data(), O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+        close(dfd);
+        if (nfd < 0) {
+            warn("could not open cgroup '%s'", ent.path.data());
+            return false;
+        }
+        dfd = nfd;
+        i = (sl == std::string::npos) ? ent.path.size() : (sl + 1);
+    }
+    bool ret = true;
+    for (auto &attr: ent.attrs) {
+        if (!resolve_value(attr)) {
+            warnx(
+                "%s: invalid value '%s' for '%s'", ent.path.data(),
+                attr.value.data(), attr.name.data()
+            );
+            ret = false;
+        } else if (!write_attr(dfd, attr.name.data(), attr.value)) {
+            warn(
+                "%s: could not set '%s' to '%s'", ent.path.data(),
+                attr.name.data(), attr.value.data()
+            );
+            ret = false;
+        }
+    }
+    close(dfd);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    bool arg_n = false;
+
+    for (int c; (c = getopt(argc, argv, "hn")) >= 0;) {
+        switch (c) {
+            case 'h':
+                usage(stdout);
+                return 0;
+            case 'n':
+                arg_n = true;
+                break;
+            default:
+                warnx("invalid option -- '%c'", c);
+                usage(stderr);
+                return 1;
+        }
+    }
+
+    if (argc > optind) {
+        warnx("extra arguments are not allowed");
+        usage(stderr);
+        return 1;
+    }
+
+    if (!do_mount()) {
+        return 1;
+    }
+
+    int rootfd = open(CG_PATH, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+    if (rootfd < 0) {
+        err(1, "could not open '%s'", CG_PATH);
+    }
+
+    /* just in case */
+    struct statfs sfs;
+    if (fstatfs(rootfd, &sfs) || (sfs.f_type != CGROUP2_SUPER_MAGIC)) {
+        close(rootfd);
+        return 0;
+    }
+
+    /* we want to enable things here as it may not be possible later
+     * (e.g. cpu will not enable when there are any rt processes running)
+     */
+    enable_controllers(rootfd);
+
+    if (arg_n) {
+        close(rootfd);
+        return 0;
+    }
+
+    std::vector<conf_file> files;
+
+    conf_collect(paths, files);
+
+    /* everything here is best effort, as e.g. a typo in the configuration
+     * or a controller missing from the kernel must not hold up the boot;
+     * the problems have been warned about already
+     */
+    std::vector<cg_entry> ents;
+    for (auto &c: files) {
+        load_conf(c.path.data(), ents);
+    }
+    for (auto &e: ents) {
+        setup_cgroup(rootfd, e);
+    }
+    close(rootfd);
+    return 0;
+}
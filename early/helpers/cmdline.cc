@@ -0,0 +1,168 @@
+/*
+ * Kernel command line helper
+ *
+ * Parses the kernel command line once and caches the result for the
+ * rest of the boot, and answers queries about it. The cache has one
+ * parameter per line, so scripts can read it without spawning anything.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 q66 <q66@chimera-linux.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cmdline_common.hh"
+
+static void usage(FILE *f) {
+    extern char const *__progname;
+    std::fprintf(f, "Usage: %s command [arg]...\n"
+"\n"
+"Parse and query the kernel command line.\n"
+"\n"
+"Commands:\n"
+"  cache      Parse the command line and cache it in " CMDLINE_PATH ".\n"
+"  show       Print all parameters, one per line, followed by a line\n"
+"             with -- and the init arguments if there are any.\n"
+"  get KEY... Print the value of the last parameter or init argument\n"
+"             named by any KEY, failing if there is none.\n",
+        __progname
+    );
+}
+
+/* the cache is only an optimization, as the readers fall back to parsing
+ * /proc/cmdline without it, so failing to write it never fails the service
+ */
+static int do_cache() {
+    std::vector<cmdline_param> params, init;
+    if (!cmdline_load_all(params, init, false)) {
+        warn("could not read kernel command line");
+        return 0;
+    }
+    auto data = cmdline_format(params, init);
+    if ((mkdir("/run/dinit", 0755) < 0) && (errno != EEXIST)) {
+        warn("could not create /run/dinit");
+        return 0;
+    }
+    /* replaced atomically, readers never see a partial file */
+    char const *tmp = CMDLINE_PATH ".new";
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        warn("could not open '%s'", tmp);
+        return 0;
+    }
+    for (std::size_t off = 0; off < data.size();) {
+        auto ret = write(fd, data.data() + off, data.size() - off);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            warn("could not write '%s'", tmp);
+            close(fd);
+            unlink(tmp);
+            return 0;
+        }
+        off += ret;
+    }
+    close(fd);
+    if (rename(tmp, CMDLINE_PATH) < 0) {
+        warn("could not rename '%s'", tmp);
+        unlink(tmp);
+        return 0;
+    }
+    return 0;
+}
+
+static int do_show() {
+    std::vector<cmdline_param> params, init;
+    if (!cmdline_load_all(params, init)) {
+        err(1, "could not read kernel command line");
+    }
+    auto data = cmdline_format(params, init);
+    std::fwrite(data.data(), 1, data.size(), stdout);
+    return 0;
+}
+
+static int do_get(int nkeys, char **keys) {
+    std::vector<cmdline_param> params, init;
+    if (!cmdline_load_all(params, init)) {
+        err(1, "could not read kernel command line");
+    }
+    /* init arguments are looked at too, like the scripts always did */
+    params.insert(
+        params.end(), std::make_move_iterator(init.begin()),
+        std::make_move_iterator(init.end())
+    );
+    /* later parameters override earlier ones */
+    for (auto it = params.rbegin(); it != params.rend(); ++it) {
+        for (int i = 0; i < nkeys; ++i) {
+            if (cmdline_match(*it, keys[i])) {
+                std::printf("%s\n", it->value.data());
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage(stderr);
+        return 1;
+    }
+    if (!std::strcmp(argv[1], "cache")) {
+        if (argc != 2) {
+            errx(1, "incorrect number of arguments");
+        }
+        return do_cache();
+    } else if (!std::strcmp(argv[1], "show")) {
+        if (argc != 2) {
+            errx(1, "incorrect number of arguments");
+        }
+        return do_show();
+    } else if (!std::strcmp(argv[1], "get")) {
+        if (argc < 3) {
+            errx(1, "incorrect number of arguments");
+        }
+        return do_get(argc - 2, &argv[2]);
+    } else if (!std::strcmp(argv[1], "help")) {
+        usage(stdout);
+        return 0;
+    }
+    usage(stderr);
+    return 1;
+}
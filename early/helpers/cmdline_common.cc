@@ -0,0 +1,242 @@
+/*
+ * Kernel command line parsing for the helpers
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 q66 <q66@chimera-linux.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cmdline_common.hh"
+
+static bool is_space(char c) {
+    return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\r');
+}
+
+static std::string normalize_key(std::string_view s) {
+    std::string ret{s};
+    for (auto &c: ret) {
+        if (c == '-') {
+            c = '_';
+        }
+    }
+    return ret;
+}
+
+/* mirrors next_arg() in lib/cmdline.c */
+void cmdline_parse(
+    std::string_view s, std::vector<cmdline_param> &out,
+    std::vector<cmdline_param> *init
+) {
+    std::vector<cmdline_param> *cur = &out;
+    std::size_t i = 0;
+    for (;;) {
+        while ((i < s.size()) && is_space(s[i])) {
+            ++i;
+        }
+        if (i >= s.size()) {
+            break;
+        }
+        bool quoted = false;
+        std::size_t b = i, eq = std::string_view::npos;
+        for (; i < s.size(); ++i) {
+            if (is_space(s[i]) && !quoted) {
+                break;
+            }
+            if ((eq == std::string_view::npos) && (s[i] == '=')) {
+                eq = i;
+            }
+            if (s[i] == '"') {
+                quoted = !quoted;
+            }
+        }
+        auto arg = s.substr(b, i - b);
+        /* a quote opening the whole thing is dropped along with the one
+         * closing it, and so are quotes around the value
+         */
+        if (eq == std::string_view::npos) {
+            if ((arg == "--") && (cur == &out)) {
+                /* the rest goes to init */
+                if (!init) {
+                    break;
+                }
+                cur = init;
+                continue;
+            }
+            if ((arg.size() > 1) && (arg.front() == '"')) {
+                arg.remove_prefix(1);
+                if (arg.back() == '"') {
+                    arg.remove_suffix(1);
+                }
+            }
+            cur->push_back(cmdline_param{normalize_key(arg), {}, false});
+            continue;
+        }
+        auto key = arg.substr(0, eq - b);
+        auto val = arg.substr(eq - b + 1);
+        bool strip = false;
+        if (!key.empty() && (key.front() == '"')) {
+            key.remove_prefix(1);
+            strip = true;
+        }
+        if (!val.empty() && (val.front() == '"')) {
+            val.remove_prefix(1);
+            strip = true;
+        }
+        if (strip && !val.empty() && (val.back() == '"')) {
+            val.remove_suffix(1);
+        }
+        cur->push_back(
+            cmdline_param{normalize_key(key), std::string{val}, true}
+        );
+    }
+}
+
+static bool read_all(char const *path, std::string &out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    char buf[4096];
+    for (;;) {
+        auto ret = read(fd, buf, sizeof(buf));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int serr = errno;
+            close(fd);
+            errno = serr;
+            return false;
+        } else if (ret == 0) {
+            break;
+        }
+        out.append(buf, ret);
+    }
+    close(fd);
+    return true;
+}
+
+static bool load_impl(
+    std::vector<cmdline_param> &out, std::vector<cmdline_param> *init,
+    bool cached
+) {
+    std::string buf;
+    if (cached && read_all(CMDLINE_PATH, buf)) {
+        std::vector<cmdline_param> *cur = &out;
+        std::string_view sv{buf};
+        while (!sv.empty()) {
+            auto nl = sv.find('\n');
+            auto ln = sv.substr(0, nl);
+            if (nl == std::string_view::npos) {
+                sv = std::string_view{};
+            } else {
+                sv.remove_prefix(nl + 1);
+            }
+            if (ln.empty()) {
+                continue;
+            }
+            /* never a kernel parameter, so it can only be the separator */
+            if ((ln == "--") && (cur == &out)) {
+                if (!init) {
+                    break;
+                }
+                cur = init;
+                continue;
+            }
+            auto eq = ln.find('=');
+            if (eq == std::string_view::npos) {
+                cur->push_back(cmdline_param{std::string{ln}, {}, false});
+            } else {
+                cur->push_back(cmdline_param{
+                    std::string{ln.substr(0, eq)},
+                    std::string{ln.substr(eq + 1)}, true
+                });
+            }
+        }
+        return true;
+    }
+    buf.clear();
+    if (!read_all("/proc/cmdline", buf)) {
+        return false;
+    }
+    cmdline_parse(buf, out, init);
+    return true;
+}
+
+bool cmdline_load(std::vector<cmdline_param> &out, bool cached) {
+    return load_impl(out, nullptr, cached);
+}
+
+bool cmdline_load_all(
+    std::vector<cmdline_param> &out, std::vector<cmdline_param> &init,
+    bool cached
+) {
+    return load_impl(out, &init, cached);
+}
+
+static void format_params(
+    std::string &ret, std::vector<cmdline_param> const &params
+) {
+    for (auto &p: params) {
+        ret += p.key;
+        if (p.has_value) {
+            ret += '=';
+            ret += p.value;
+        }
+        ret += '\n';
+    }
+}
+
+std::string cmdline_format(
+    std::vector<cmdline_param> const &params,
+    std::vector<cmdline_param> const &init
+) {
+    std::string ret;
+    format_params(ret, params);
+    if (!init.empty()) {
+        ret += "--\n";
+        format_params(ret, init);
+    }
+    return ret;
+}
+
+bool cmdline_match(cmdline_param const &p, std::string_view key) {
+    if (p.key.size() != key.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < key.size(); ++i) {
+        char c = (key[i] == '-') ? '_' : key[i];
+        if (p.key[i] != c) {
+            return false;
+        }
+    }
+    return true;
+}
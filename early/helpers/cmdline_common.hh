@@ -0,0 +1,81 @@
+/*
+ * Kernel command line parsing for the helpers
+ *
+ * The command line is split the way the kernel does it and cached under
+ * /run/dinit as one parameter per line, so that every consumer sees the
+ * same thing.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 q66 <q66@chimera-linux.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef CMDLINE_COMMON_H
+#define CMDLINE_COMMON_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define CMDLINE_PATH "/run/dinit/cmdline"
+
+struct cmdline_param {
+    /* with dashes turned into underscores, as the kernel compares them */
+    std::string key;
+    std::string value;
+    bool has_value;
+};
+
+/* split a command line into parameters, up to a "--" if any; what comes
+ * after it is passed to init rather than parsed by the kernel, and goes
+ * into init if given
+ */
+void cmdline_parse(
+    std::string_view s, std::vector<cmdline_param> &out,
+    std::vector<cmdline_param> *init = nullptr
+);
+
+/* load the cached parameters, or parse /proc/cmdline if not cached yet;
+ * false with errno set if neither can be read
+ */
+bool cmdline_load(std::vector<cmdline_param> &out, bool cached = true);
+
+/* same as above, but also get the init arguments after the "--" */
+bool cmdline_load_all(
+    std::vector<cmdline_param> &out, std::vector<cmdline_param> &init,
+    bool cached = true
+);
+
+/* the cache format, a parameter per line as key or key=value, followed
+ * by a "--" line and the init arguments if there are any
+ */
+std::string cmdline_format(
+    std::vector<cmdline_param> const &params,
+    std::vector<cmdline_param> const &init
+);
+
+/* whether the given key matches the param key, with the same rules */
+bool cmdline_match(cmdline_param const &p, std::string_view key);
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ * Common configuration file handling for the helpers
+ *
+ * Implements the usual *.d drop-in directory semantics as well as
+ * cheap line-wise reading of the configuration files.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 q66 <q66@chimera-linux.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "conf_common.hh"
+
+void conf_collect(char const * const *paths, std::vector<conf_file> &files) {
+    std::unordered_set<std::string> seen;
+    for (char const * const *p = paths; *p; ++p) {
+        int dfd = open(*p, O_RDONLY | O_DIRECTORY);
+        if (dfd < 0) {
+            continue;
+        }
+        conf_scandir(dfd, [&](char const *dn, unsigned char dt) {
+            /* must be a regular file or a symlink to regular file */
+            if (dt != DT_REG) {
+                struct stat st;
+                if ((dt != DT_LNK) && (dt != DT_UNKNOWN)) {
+                    return;
+                }
+                if (
+                    (fstatat(dfd, dn, &st, 0) < 0) || !S_ISREG(st.st_mode)
+                ) {
+                    return;
+                }
+            }
+            /* check if it matches .conf */
+            auto sl = std::strlen(dn);
+            if ((sl <= 5) || std::strcmp(dn + sl - 5, ".conf")) {
+                return;
+            }
+            /* check if already overridden */
+            if (!seen.emplace(dn).second) {
+                return;
+            }
+            /* otherwise use its full name */
+            std::string fp = *p;
+            fp.push_back('/');
+            fp += dn;
+            files.push_back(conf_file{dn, std::move(fp)});
+        });
+        close(dfd);
+    }
+    std::sort(files.begin(), files.end(), [](auto &a, auto &b) {
+        return (a.name < b.name);
+    });
+}
+
+bool conf_reader::open(char const *path) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int serr = errno;
+        close(fd);
+        errno = serr;
+        return false;
+    }
+    buf.clear();
+    pos = 0;
+    /* the size is only a hint, read until the end either way */
+    std::size_t cap = (st.st_size > 0) ? std::size_t(st.st_size) : 0;
+    buf.resize(cap + 1);
+    std::size_t len = 0;
+    for (;;) {
+        if (len == buf.size()) {
+            buf.resize(buf.size() * 2);
+        }
+        auto ret = read(fd, &buf[len], buf.size() - len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int serr = errno;
+            close(fd);
+            buf.clear();
+            errno = serr;
+            return false;
+        }
+        if (!ret) {
+            break;
+        }
+        len += std::size_t(ret);
+    }
+    close(fd);
+    buf.resize(len);
+    return true;
+}
+
+bool conf_reader::next_span(std::size_t &beg, std::size_t &end) {
+    char const *map = buf.data();
+    std::size_t size = buf.size();
+    while (pos < size) {
+        char const *lp = map + pos;
+        auto *le = static_cast<char const *>(
+            std::memchr(lp, '\n', size - pos)
+        );
+        if (!le) {
+            le = map + size;
+        }
+        pos = std::size_t(le - map) + 1;
+        /* strip leading whitespace and ignore comments, empty lines etc */
+        while ((lp < le) && std::isspace(*lp)) {
+            ++lp;
+        }
+        if ((lp == le) || (*lp == '#') || (*lp == ';')) {
+            continue;
+        }
+        /* strip trailing whitespace too once we are sure it's not empty */
+        while (std::isspace(le[-1])) {
+            --le;
+        }
+        beg = std::size_t(lp - map);
+        end = std::size_t(le - map);
+        return true;
+    }
+    return false;
+}
+
+bool conf_reader::next(std::string_view &line) {
+    std::size_t beg, end;
+    if (!next_span(beg, end)) {
+        return false;
+    }
+    line = std::string_view{buf.data() + beg, end - beg};
+    return true;
+}
+
+bool conf_reader::next(char *&line) {
+    std::size_t beg, end;
+    if (!next_span(beg, end)) {
+        return false;
+    }
+    /* at worst the terminator of the string itself, which is allowed */
+    buf[end] = '\0';
+    line = &buf[beg];
+    return true;
+}
@@ -0,0 +1,91 @@
+#ifndef CONF_COMMON_H
+#define CONF_COMMON_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+
+/* kernel dirent layout for getdents64 */
+struct conf_dirent64 {
+    std::uint64_t d_ino;
+    std::int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+/* call cb(name, d_type) for every entry in the directory other than
+ * . and .., reading it in large chunks; false on read error
+ */
+template<typename F>
+bool conf_scandir(int dfd, F &&cb) {
+    alignas(conf_dirent64) char buf[16384];
+    for (;;) {
+        auto nread = syscall(SYS_getdents64, dfd, buf, sizeof(buf));
+        if (nread < 0) {
+            return false;
+        } else if (nread == 0) {
+            return true;
+        }
+        for (long off = 0; off < nread;) {
+            auto *de = reinterpret_cast<conf_dirent64 *>(buf + off);
+            off += de->d_reclen;
+            char const *dn = de->d_name;
+            if ((dn[0] == '.') && (!dn[1] || ((dn[1] == '.') && !dn[2]))) {
+                continue;
+            }
+            cb(dn, de->d_type);
+        }
+    }
+}
+
+struct conf_file {
+    std::string name;
+    std::string path;
+};
+
+/* collect .conf files (or symlinks to them) from the given null-terminated
+ * list of directories, in order of precedence; a file name in an earlier
+ * directory overrides the same name in the later ones, and the result is
+ * sorted by file name
+ */
+void conf_collect(char const * const *paths, std::vector<conf_file> &files);
+
+/* a configuration file read into memory in one go; these are small, so
+ * reading them whole is cheaper than a mapping, and owning the buffer
+ * lets lines be terminated in place for the users that need C strings
+ */
+struct conf_reader {
+    std::string buf;
+    std::size_t pos = 0;
+
+    /* false with errno set on failure */
+    bool open(char const *path);
+
+    std::string_view data() const {
+        return buf;
+    }
+
+    /* get the next line that is not empty or a comment, with the leading
+     * and trailing whitespace stripped, pointing into the buffer; false
+     * at the end of the file
+     */
+    bool next(std::string_view &line);
+
+    /* same as above, but the line is null-terminated in place and may be
+     * modified by the caller up to the terminator
+     */
+    bool next(char *&line);
+
+private:
+    bool next_span(std::size_t &beg, std::size_t &end);
+};
+
+#endif
@@ -66,10 +66,14 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 
 #include <libdinitctl.h>
 
+#include "trace_common.hh"
+
 #ifndef HAVE_UDEV
 #error Compiling devmon without udev
 #endif
@@ -100,7 +104,7 @@ enum {
 };
 
 static bool sock_new(char const *path, int &sock, mode_t mode) {
-    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sock < 0) {
         warn("socket failed");
         return false;
@@ -839,6 +843,50 @@ static bool initial_populate(struct udev_enumerate *en) {
     return true;
 }
 
+#ifdef SYSCTL_HELPER
+/* interfaces appearing after boot need their own sysctls applied; the
+ * helper is not waited for, the children are reaped on SIGCHLD
+ */
+static void netif_sysctl(struct udev_device *dev) {
+    auto *ifname = udev_device_get_sysname(dev);
+    if (!ifname) {
+        return;
+    }
+    auto cpid = fork();
+    if (cpid < 0) {
+        warn("fork failed");
+        return;
+    }
+    if (cpid == 0) {
+        /* our own descriptors are set close-on-exec, but the libraries'
+         * may not be, and the helper has no business with any of them
+         */
+#ifdef SYS_close_range
+        if (syscall(SYS_close_range, 3, ~0U, 0) < 0)
+#endif
+        {
+            for (long fd = 3, maxfd = sysconf(_SC_OPEN_MAX); fd < maxfd; ++fd) {
+                close(int(fd));
+            }
+        }
+        /* the sysctl output would only end up in our log */
+        int nfd = open("/dev/null", O_WRONLY);
+        if (nfd >= 0) {
+            dup2(nfd, STDOUT_FILENO);
+            if (nfd != STDOUT_FILENO) {
+                close(nfd);
+            }
+        }
+        umask(022);
+        execl(
+            SYSCTL_HELPER, SYSCTL_HELPER, "--only-changed", "--netif",
+            ifname, nullptr
+        );
+        _exit(127);
+    }
+}
+#endif
+
 static bool resolve_device(struct udev_monitor *mon, bool tagged) {
     auto *dev = udev_monitor_receive_device(mon);
     if (!dev) {
@@ -878,12 +926,17 @@ static bool resolve_device(struct udev_monitor *mon, bool tagged) {
     } else {
         ret = add_device(dev, sysp, ssys);
     }
+#ifdef SYSCTL_HELPER
+    if (ret && !std::strcmp(act, "add") && !std::strcmp(ssys, "net")) {
+        netif_sysctl(dev);
+    }
+#endif
     udev_device_unref(dev);
     return ret;
 }
 #endif
 
-int main(void) {
+int main(int, char **) {
     /* simple signal handler for SIGTERM/SIGINT */
     {
         struct sigaction sa{};
@@ -892,6 +945,8 @@ int main(void) {
         sigemptyset(&sa.sa_mask);
         sigaction(SIGTERM, &sa, nullptr);
         sigaction(SIGINT, &sa, nullptr);
+        /* spawned helpers are reaped from the main loop */
+        sigaction(SIGCHLD, &sa, nullptr);
     }
 
     umask(077);
@@ -900,7 +955,7 @@ int main(void) {
 
     /* signal pipe */
     {
-        if (pipe(sigpipe) < 0) {
+        if (pipe2(sigpipe, O_CLOEXEC) < 0) {
             warn("pipe failed");
             return 1;
         }
@@ -1053,6 +1108,7 @@ int main(void) {
         return 1;
     }
 
+    trace_event("coldplug");
     if (!initial_populate(en1) || !initial_populate(en2)) {
         udev_enumerate_unref(en1);
         udev_enumerate_unref(en2);
@@ -1062,6 +1118,7 @@ int main(void) {
 
     udev_enumerate_unref(en1);
     udev_enumerate_unref(en2);
+    trace_event("monitor");
 
     {
         auto &pfd1 = fds.emplace_back();
@@ -1120,13 +1177,19 @@ int main(void) {
                 warn("signal read failed");
                 goto do_compact;
             }
-            /* sigterm or sigint */
-            break;
+            if (sign != SIGCHLD) {
+                /* sigterm or sigint */
+                break;
+            }
+            /* don't leave zombies from spawned helpers */
+            while (waitpid(-1, nullptr, WNOHANG) > 0) {}
         }
         /* check for incoming connections */
         if (fds[++ni].revents) {
             for (;;) {
-                auto afd = accept4(fds[ni].fd, nullptr, nullptr, SOCK_NONBLOCK);
+                auto afd = accept4(
+                    fds[ni].fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC
+                );
                 if (afd < 0) {
                     if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
                         warn("accept4 failed");
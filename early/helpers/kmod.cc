@@ -31,9 +31,7 @@
  * SUCH DAMAGE.
  */
 
-#include <unordered_map>
 #include <unordered_set>
-#include <algorithm>
 #include <vector>
 #include <string>
 #include <cctype>
@@ -45,11 +43,18 @@
 
 #include <err.h>
 #include <unistd.h>
-#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/utsname.h>
 
 #include <libkmod.h>
 
+#include "cmdline_common.hh"
+#include "conf_common.hh"
+#include "trace_common.hh"
+
 static std::unordered_set<std::string_view> *kernel_blacklist = nullptr;
 
 /* search paths for conf files */
@@ -68,9 +73,10 @@ static void usage(FILE *f) {
 "Kernel module helper tool.\n"
 "\n"
 "Commands:\n"
-"  static-modules  Load early static kernel modules.\n"
-"  modules         Load modules specified in modules-load.d.\n"
-"  load MODNAME    Load the module MODNAME.\n",
+"  static-modules [nodes]  Load early static kernel modules, optionally\n"
+"                          creating their static device nodes.\n"
+"  modules                 Load modules specified in modules-load.d.\n"
+"  load MODNAME            Load the module MODNAME.\n",
         __progname
     );
 }
@@ -126,41 +132,133 @@ static int mod_load(struct kmod_ctx *ctx, char const *modname) {
     return ret;
 }
 
-static bool load_conf(
-    struct kmod_ctx *ctx, char const *s, char *&line, std::size_t &len
-) {
-    FILE *f = std::fopen(s, "rb");
-    if (!f) {
+static bool load_conf(struct kmod_ctx *ctx, char const *s) {
+    conf_reader rd;
+    if (!rd.open(s)) {
         warnx("could not load '%s'", s);
         return false;
     }
     bool fret = true;
-    for (ssize_t nread; (nread = getline(&line, &len, f)) != -1;) {
-        /* strip leading whitespace and ignore comments, empty lines etc */
-        char *cline = line;
-        while (std::isspace(*cline)) {
-            ++cline;
+    /* the module name needs to be terminated, which is done in place */
+    for (char *modname; rd.next(modname);) {
+        /* try loading the module */
+        if (mod_load(ctx, modname) < 0) {
+            warn("failed to load module '%s'", modname);
+            fret = false;
+        }
+    }
+    return fret;
+}
+
+struct static_node {
+    char *modname;
+    char *devname;
+    char type;
+    unsigned int major;
+    unsigned int minor;
+};
+
+/* parse the whole modules.devname in one pass; the file is mapped private
+ * and writable so we can terminate the names in place without copying, the
+ * format is one "module devname {c,b}MAJ:MIN" per line; a malformed line is
+ * skipped, so that the rest of the modules still get loaded
+ */
+static void parse_devname(
+    char *buf, std::size_t size, std::vector<static_node> &nodes
+) {
+    char *end = buf + size;
+    for (char *lp = buf; lp < end;) {
+        char *le = static_cast<char *>(std::memchr(lp, '\n', end - lp));
+        if (!le) {
+            le = end;
         }
-        if ((*cline == '#') || (*cline == ';') || !*cline) {
+        char *cl = lp;
+        lp = le + 1;
+        /* skip comments and empty lines */
+        if ((cl == le) || (*cl == '#')) {
             continue;
         }
-        /* strip trailing whitespace too once we are sure it's not empty */
-        auto rl = std::strlen(line);
-        while (std::isspace(line[rl - 1])) {
-            line[--rl] = '\0';
+        static_node nd;
+        /* module name */
+        nd.modname = cl;
+        while ((cl < le) && !std::isspace(*cl)) {
+            ++cl;
         }
-        /* try loading the module */
-        if (mod_load(ctx, line) < 0) {
-            warn("failed to load module '%s'", line);
-            fret = false;
+        if (cl == le) {
+            warnx("malformed modules.devname entry");
+            continue;
+        }
+        *cl++ = '\0';
+        while ((cl < le) && std::isspace(*cl)) {
+            ++cl;
+        }
+        /* device node name */
+        nd.devname = cl;
+        while ((cl < le) && !std::isspace(*cl)) {
+            ++cl;
+        }
+        if (cl == le) {
+            warnx("malformed modules.devname entry");
+            continue;
+        }
+        *cl++ = '\0';
+        while ((cl < le) && std::isspace(*cl)) {
+            ++cl;
+        }
+        /* type and numbers */
+        nd.type = (cl < le) ? *cl++ : '\0';
+        if ((nd.type != 'c') && (nd.type != 'b')) {
+            warnx("invalid node type for '%s'", nd.devname);
+            continue;
+        }
+        unsigned int *num = &nd.major;
+        *num = 0;
+        bool got = false;
+        for (; cl < le; ++cl) {
+            if ((*cl == ':') && (num == &nd.major) && got) {
+                num = &nd.minor;
+                *num = 0;
+                got = false;
+                continue;
+            } else if ((*cl < '0') || (*cl > '9')) {
+                break;
+            }
+            *num = *num * 10 + (*cl - '0');
+            got = true;
+        }
+        if ((num != &nd.minor) || !got) {
+            warnx("invalid node numbers for '%s'", nd.devname);
+            continue;
+        }
+        nodes.push_back(nd);
+    }
+}
+
+/* create the node in /dev so that opening it may autoload the module later,
+ * the same thing `kmod static-nodes` + tmpfiles would have done for us
+ */
+static void create_node(int devfd, static_node const &nd) {
+    /* ensure parent directories exist */
+    for (char *sl = nd.devname; (sl = std::strchr(sl, '/')); ++sl) {
+        *sl = '\0';
+        if ((mkdirat(devfd, nd.devname, 0755) < 0) && (errno != EEXIST)) {
+            warn("could not create '/dev/%s'", nd.devname);
+            *sl = '/';
+            return;
+        }
+        *sl = '/';
+    }
+    mode_t mode = (nd.type == 'c') ? S_IFCHR : S_IFBLK;
+    if (mknodat(
+        devfd, nd.devname, mode | 0600, makedev(nd.major, nd.minor)
+    ) < 0) {
+        if (errno != EEXIST) {
+            warn("could not create '/dev/%s'", nd.devname);
         }
     }
-    std::fclose(f);
-    return fret;
 }
 
-static int do_static_modules(struct kmod_ctx *ctx) {
-    char buf[256], *bufp;
+static int do_static_modules(struct kmod_ctx *ctx, bool mknodes) {
     int modb = open("/lib/modules", O_DIRECTORY | O_PATH);
     if (modb < 0) {
         if (errno == ENOENT) {
@@ -194,41 +292,47 @@ static int do_static_modules(struct kmod_ctx *ctx) {
         close(kernb);
         return 2;
     }
-    FILE *df = fdopen(devf, "rb");
-    if (!df) {
-        warn("could not reopen modules.devname as file stream");
+    close(kernb);
+    struct stat st;
+    if (fstat(devf, &st) < 0) {
+        warn("could not stat modules.devname");
         close(devf);
         return 2;
     }
-    while ((bufp = std::fgets(buf, sizeof(buf), df))) {
-        auto sl = std::strlen(bufp);
-        /* extract the module name */
-        char *sp = std::strchr(bufp, ' ');
-        if (sp) {
-            *sp = '\0';
-        }
-        /* skip comments */
-        if (bufp[0] != '#') {
-            if (mod_load(ctx, bufp) < 0) {
-                /* we don't want early-modules to fail if possible,
-                 * but an error message is nice so display it anyway
-                 */
-                warn("failed to load module '%s'", bufp);
-            }
-        }
-        /* exhaust the rest of the line just in case */
-        while (bufp[sl - 1] != '\n') {
-            bufp = std::fgets(buf, sizeof(buf), df);
-            if (!bufp) {
-                break;
+    if (st.st_size == 0) {
+        /* nothing to do */
+        close(devf);
+        return 0;
+    }
+    auto sz = std::size_t(st.st_size);
+    void *mp = mmap(nullptr, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE, devf, 0);
+    close(devf);
+    if (mp == MAP_FAILED) {
+        warn("could not map modules.devname");
+        return 2;
+    }
+    std::vector<static_node> nodes;
+    parse_devname(static_cast<char *>(mp), sz, nodes);
+    if (mknodes) {
+        int devfd = open("/dev", O_DIRECTORY | O_PATH);
+        if (devfd < 0) {
+            warn("opening /dev failed");
+        } else {
+            for (auto &nd: nodes) {
+                create_node(devfd, nd);
             }
-            sl = std::strlen(bufp);
+            close(devfd);
         }
-        /* bail early if we exhausted all without another fgets */
-        if (!bufp) {
-            break;
+    }
+    for (auto &nd: nodes) {
+        if (mod_load(ctx, nd.modname) < 0) {
+            /* we don't want early-modules to fail if possible,
+             * but an error message is nice so display it anyway
+             */
+            warn("failed to load module '%s'", nd.modname);
         }
     }
+    munmap(mp, sz);
     return 0;
 }
 
@@ -243,6 +347,7 @@ static int do_load(struct kmod_ctx *ctx, char const *modname) {
 int main(int argc, char **argv) {
     bool is_static_mods = false;
     bool is_load = false;
+    bool mknodes = false;
 
     if (argc <= 1) {
         usage(stderr);
@@ -266,19 +371,24 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    /* optional argument */
+    if (is_static_mods && (argc > 2)) {
+        if (std::strcmp(argv[2], "nodes")) {
+            usage(stderr);
+            return 1;
+        }
+        mknodes = true;
+    }
+
     if ((access("/proc/modules", F_OK) < 0) && (errno == ENOENT)) {
         /* kernel not modular, all succeeds */
         return 0;
     }
 
-    std::unordered_map<std::string, std::string> got_map;
+    std::vector<conf_file> files;
     std::unordered_set<std::string_view> kern_bl;
-    std::vector<std::string const *> ord_list;
-    std::vector<char const *> cmdl_mods;
-    char *line = nullptr;
-    std::size_t len = 0;
-    /* we cannot seek on kernel cmdline, but it has a guaranteed max length */
-    char kerncmd[4097] = {};
+    std::vector<std::string> cmdl_mods;
+    std::vector<cmdline_param> cmdl;
     int ret = 0;
 
     kernel_blacklist = &kern_bl;
@@ -291,132 +401,55 @@ int main(int argc, char **argv) {
     kmod_load_resources(kctx);
 
     /* modules_load, modules-load, module_blacklist */
-    FILE *cmdl = std::fopen("/proc/cmdline", "rb");
-    if (cmdl) {
-        auto len = std::fread(kerncmd, 1, sizeof(kerncmd) - 1, cmdl);
-        if ((len > 0) && (kerncmd[len - 1] == '\n')) {
-            /* may end with a trailing newline */
-            kerncmd[len - 1] = '\0';
+    cmdline_load(cmdl);
+    for (auto &prm: cmdl) {
+        bool load = cmdline_match(prm, "modules_load");
+        if (!load && !cmdline_match(prm, "module_blacklist")) {
+            continue;
         }
-        for (char *p = kerncmd; (p = std::strstr(p, "module"));) {
-            /* inside of a param, skip */
-            if ((p != kerncmd) && p[-1] && (p[-1] != ' ')) {
-                p += 6;
-                continue;
+        std::string_view lst = prm.value;
+        while (!lst.empty()) {
+            auto w = lst.find(',');
+            auto modn = lst.substr(0, w);
+            if (modn.empty()) {
+                /* maybe had a trailing comma */
+            } else if (load) {
+                cmdl_mods.emplace_back(modn);
+            } else {
+                /* points into cmdl, which outlives it */
+                kernel_blacklist->emplace(modn);
             }
-            /* find a = */
-            char *e = std::strpbrk(p, "= ");
-            /* no useful data anymore */
-            if (!e) {
-                break;
-            }
-            /* located end earlier */
-            if (*e == ' ') {
-                p = e + 1;
-                continue;
-            }
-            bool load = false;
-            if (
-                !std::strncmp(p, "modules_load", e - p) ||
-                !std::strncmp(p, "modules-load", e - p)
-            ) {
-                load = true;
-            } else if (std::strncmp(p, "module_blacklist", e - p)) {
-                /* invalid */
-                p = e + 1;
-                continue;
-            }
-            /* now parse the list after e */
-            p = e + 1;
-            for (;;) {
-                auto w = std::strcspn(p, ", ");
-                if (!w) {
-                    /* maybe had a trailing comma */
-                    break;
-                }
-                char c = p[w];
-                p[w] = '\0';
-                if (load) {
-                    cmdl_mods.push_back(p);
-                } else {
-                    kernel_blacklist->emplace(p);
-                }
-                if (c == ',') {
-                    /* the list continues, move past the comma */
-                    p += w + 1;
-                    continue;
-                } else if (c == ' ') {
-                    /* the list ends, move past the space */
-                    p += w + 1;
-                    break;
-                }
-                /* everything ends */
-                p += w;
+            if (w == std::string_view::npos) {
                 break;
             }
+            lst.remove_prefix(w + 1);
         }
     }
 
     if (is_static_mods) {
-        ret = do_static_modules(kctx);
+        ret = do_static_modules(kctx, mknodes);
         goto do_ret;
     } else if (is_load) {
         ret = do_load(kctx, argv[2]);
         goto do_ret;
     }
 
-    for (char const **p = paths; *p; ++p) {
-        DIR *dfd = opendir(*p);
-        if (!dfd) {
-            continue;
-        }
-        struct dirent *dp;
-        while ((dp = readdir(dfd))) {
-            /* must be a regular file */
-            if (dp->d_type != DT_REG) {
-                continue;
-            }
-            /* check if it matches .conf */
-            char const *dn = dp->d_name;
-            auto sl = std::strlen(dn);
-            if ((sl <= 5) || strcmp(dn + sl - 5, ".conf")) {
-                continue;
-            }
-            /* check if already in map */
-            if (got_map.find(dn) != got_map.end()) {
-                continue;
-            }
-            /* otherwise use its full name */
-            std::string fp = *p;
-            fp.push_back('/');
-            fp += dp->d_name;
-            got_map.emplace(dn, std::move(fp));
-        }
-        closedir(dfd);
-    }
-
-    /* construct a sorted vector of names, backed by map memory */
-    for (auto &p: got_map) {
-        ord_list.push_back(&p.first);
-    }
-    std::sort(ord_list.begin(), ord_list.end(), [](auto a, auto b) {
-        return (*a < *b);
-    });
+    conf_collect(paths, files);
 
     /* load modules from command line */
-    for (auto modn: cmdl_mods) {
-        if (do_load(kctx, modn)) {
+    for (auto &modn: cmdl_mods) {
+        if (do_load(kctx, modn.data())) {
             ret = 2;
         }
     }
     /* now register or print each conf */
-    for (auto &c: ord_list) {
-        if (!load_conf(kctx, got_map[*c].data(), line, len)) {
+    for (auto &c: files) {
+        trace_event(c.name.data());
+        if (!load_conf(kctx, c.path.data())) {
             ret = 2;
         }
     }
 do_ret:
-    std::free(line);
     if (kctx) {
         kmod_unref(kctx);
     }
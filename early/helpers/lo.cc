@@ -1,7 +1,14 @@
 /*
  * Loopback device bringup helper
  *
- * Does the same thing as `ip link set up dev lo`.
+ * Does the same thing as `ip link set up dev lo`, and makes sure that the
+ * usual loopback addresses are present, adding them if they are missing
+ * (e.g. in network namespaces set up by something else). The current
+ * state is dumped first and only the changes that are actually needed
+ * are then sent as a single batch of rtnetlink requests, so that nothing
+ * is requested (and nothing fails for lack of CAP_NET_ADMIN, e.g. in a
+ * container) when everything is already set up. The batch may also bring
+ * up the links of other interfaces, listed one per line in links.d files.
  *
  * SPDX-License-Identifier: BSD-2-Clause
  *
@@ -33,15 +40,59 @@
 #define _GNU_SOURCE
 #endif
 
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 #include <err.h>
+#include <unistd.h>
 #include <net/if.h>
+#include <netinet/in.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
-int main(void) {
+#include "conf_common.hh"
+
+/* the loopback device always has this index, see LOOPBACK_IFINDEX */
+#define LO_INDEX 1
+
+/* search paths for conf files */
+static char const *paths[] = {
+    "/etc/links.d",
+    "/run/links.d",
+    "/usr/local/lib/links.d",
+    "/usr/lib/links.d",
+    nullptr
+};
+
+enum {
+    REQ_LINK = 0,
+    REQ_ADDR4,
+    REQ_ADDR6,
+};
+
+struct nl_req {
+    std::string ifname;
+    int kind;
+    int error = -1;
+};
+
+/* what is already there, as found by the dumps */
+struct nl_state {
+    std::vector<std::pair<std::string, bool>> links;
+    bool lo_up = false;
+    bool have4 = false;
+    bool have6 = false;
+    bool known = false;
+};
+
+static int lo_ioctl() {
     int fams[] = {PF_INET, PF_PACKET, PF_INET6, PF_UNSPEC};
     int fd = -1, serr = 0;
 
@@ -77,3 +128,359 @@ int main(void) {
 
     return 0;
 }
+
+/* the buffer is only ever appended to in aligned chunks */
+static std::size_t nl_begin(
+    std::vector<char> &buf, std::uint16_t type, std::uint16_t flags,
+    std::uint32_t seq, void const *hdr, std::size_t hlen
+) {
+    auto off = buf.size();
+    struct nlmsghdr nh{};
+    nh.nlmsg_len = NLMSG_LENGTH(hlen);
+    nh.nlmsg_type = type;
+    nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    nh.nlmsg_seq = seq;
+    buf.resize(off + NLMSG_ALIGN(nh.nlmsg_len));
+    std::memcpy(&buf[off], &nh, sizeof(nh));
+    std::memcpy(&buf[off + NLMSG_HDRLEN], hdr, hlen);
+    return off;
+}
+
+static void nl_attr(
+    std::vector<char> &buf, std::size_t msg, std::uint16_t type,
+    void const *data, std::size_t len
+) {
+    auto off = buf.size();
+    struct rtattr rta{};
+    rta.rta_len = RTA_LENGTH(len);
+    rta.rta_type = type;
+    buf.resize(off + RTA_ALIGN(rta.rta_len));
+    std::memcpy(&buf[off], &rta, sizeof(rta));
+    std::memcpy(&buf[off + RTA_LENGTH(0)], data, len);
+    auto *nh = reinterpret_cast<struct nlmsghdr *>(&buf[msg]);
+    nh->nlmsg_len = buf.size() - msg;
+}
+
+static bool link_up(nl_state const &st, std::string_view name) {
+    for (auto &lnk: st.links) {
+        if (lnk.first == name) {
+            return lnk.second;
+        }
+    }
+    return false;
+}
+
+static void add_link(
+    std::vector<char> &buf, std::vector<nl_req> &reqs, std::string_view name
+) {
+    struct ifinfomsg ifi{};
+    ifi.ifi_family = AF_UNSPEC;
+    ifi.ifi_flags = IFF_UP;
+    ifi.ifi_change = IFF_UP;
+    /* looked up by name, as the index is not known */
+    auto msg = nl_begin(
+        buf, RTM_NEWLINK, 0, reqs.size() + 1, &ifi, sizeof(ifi)
+    );
+    std::string ifname{name};
+    nl_attr(buf, msg, IFLA_IFNAME, ifname.data(), ifname.size() + 1);
+    reqs.push_back(nl_req{std::move(ifname), REQ_LINK});
+}
+
+static void add_addr(
+    std::vector<char> &buf, std::vector<nl_req> &reqs, int family,
+    void const *addr, std::size_t alen, unsigned char plen
+) {
+    struct ifaddrmsg ifa{};
+    ifa.ifa_family = family;
+    ifa.ifa_prefixlen = plen;
+    ifa.ifa_flags = IFA_F_PERMANENT;
+    ifa.ifa_scope = RT_SCOPE_HOST;
+    ifa.ifa_index = LO_INDEX;
+    /* fails with EEXIST when already present, which is what we want */
+    auto msg = nl_begin(
+        buf, RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL, reqs.size() + 1,
+        &ifa, sizeof(ifa)
+    );
+    nl_attr(buf, msg, IFA_LOCAL, addr, alen);
+    nl_attr(buf, msg, IFA_ADDRESS, addr, alen);
+    reqs.push_back(
+        nl_req{"lo", (family == AF_INET) ? REQ_ADDR4 : REQ_ADDR6}
+    );
+}
+
+static void load_links(
+    std::vector<char> &buf, std::vector<nl_req> &reqs, nl_state const &st
+) {
+    std::vector<conf_file> files;
+    conf_collect(paths, files);
+    for (auto &c: files) {
+        conf_reader rd;
+        if (!rd.open(c.path.data())) {
+            warn("could not load '%s'", c.path.data());
+            continue;
+        }
+        for (std::string_view sv; rd.next(sv);) {
+            if (
+                (sv.size() >= IFNAMSIZ) ||
+                (sv.find_first_of(" \t/") != std::string_view::npos)
+            ) {
+                warnx(
+                    "%s: invalid interface '%.*s'", c.path.data(),
+                    int(sv.size()), sv.data()
+                );
+                continue;
+            }
+            if ((sv == "lo") || link_up(st, sv)) {
+                continue;
+            }
+            add_link(buf, reqs, sv);
+        }
+    }
+}
+
+/* run a dump request, calling cb for each message; false on any failure */
+static bool nl_dump(
+    int fd, std::uint16_t type, void const *hdr, std::size_t hlen,
+    void (*cb)(struct nlmsghdr *, nl_state &), nl_state &st
+) {
+    alignas(struct nlmsghdr) char rbuf[16384];
+    std::vector<char> buf;
+    nl_begin(buf, type, NLM_F_DUMP, 0, hdr, hlen);
+    auto *req = reinterpret_cast<struct nlmsghdr *>(buf.data());
+    /* dumps are terminated by NLMSG_DONE, there is no ack to wait for */
+    req->nlmsg_flags &= ~NLM_F_ACK;
+    if (send(fd, buf.data(), buf.size(), 0) < 0) {
+        return false;
+    }
+    for (;;) {
+        auto ret = recv(fd, rbuf, sizeof(rbuf), 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        auto len = std::size_t(ret);
+        for (
+            auto *nh = reinterpret_cast<struct nlmsghdr *>(rbuf);
+            NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)
+        ) {
+            switch (nh->nlmsg_type) {
+                case NLMSG_DONE:
+                    return true;
+                case NLMSG_ERROR:
+                    return false;
+                default:
+                    cb(nh, st);
+                    break;
+            }
+        }
+    }
+}
+
+static void dump_link(struct nlmsghdr *nh, nl_state &st) {
+    if (nh->nlmsg_type != RTM_NEWLINK) {
+        return;
+    }
+    auto *ifi = static_cast<struct ifinfomsg *>(NLMSG_DATA(nh));
+    bool up = (ifi->ifi_flags & IFF_UP);
+    if (ifi->ifi_index == LO_INDEX) {
+        st.lo_up = up;
+    }
+    auto alen = IFLA_PAYLOAD(nh);
+    for (
+        auto *rta = IFLA_RTA(ifi); RTA_OK(rta, alen);
+        rta = RTA_NEXT(rta, alen)
+    ) {
+        if (rta->rta_type == IFLA_IFNAME) {
+            st.links.emplace_back(
+                static_cast<char const *>(RTA_DATA(rta)), up
+            );
+            break;
+        }
+    }
+}
+
+static void dump_addr(struct nlmsghdr *nh, nl_state &st) {
+    if (nh->nlmsg_type != RTM_NEWADDR) {
+        return;
+    }
+    auto *ifa = static_cast<struct ifaddrmsg *>(NLMSG_DATA(nh));
+    if (ifa->ifa_index != LO_INDEX) {
+        return;
+    }
+    auto alen = IFA_PAYLOAD(nh);
+    for (
+        auto *rta = IFA_RTA(ifa); RTA_OK(rta, alen);
+        rta = RTA_NEXT(rta, alen)
+    ) {
+        if ((ifa->ifa_family == AF_INET) && (ifa->ifa_prefixlen == 8)) {
+            struct in_addr a4;
+            if (
+                (rta->rta_type != IFA_LOCAL) ||
+                (RTA_PAYLOAD(rta) != sizeof(a4))
+            ) {
+                continue;
+            }
+            std::memcpy(&a4, RTA_DATA(rta), sizeof(a4));
+            if (a4.s_addr == htonl(INADDR_LOOPBACK)) {
+                st.have4 = true;
+            }
+        } else if (
+            (ifa->ifa_family == AF_INET6) && (ifa->ifa_prefixlen == 128)
+        ) {
+            if (
+                (rta->rta_type != IFA_ADDRESS) ||
+                (RTA_PAYLOAD(rta) != sizeof(in6_addr))
+            ) {
+                continue;
+            }
+            if (!std::memcmp(
+                RTA_DATA(rta), &in6addr_loopback, sizeof(in6_addr)
+            )) {
+                st.have6 = true;
+            }
+        }
+    }
+}
+
+static void nl_query(int fd, nl_state &st) {
+    struct ifinfomsg ifi{};
+    ifi.ifi_family = AF_UNSPEC;
+    struct ifaddrmsg ifa{};
+    ifa.ifa_family = AF_UNSPEC;
+    if (
+        !nl_dump(fd, RTM_GETLINK, &ifi, sizeof(ifi), dump_link, st) ||
+        !nl_dump(fd, RTM_GETADDR, &ifa, sizeof(ifa), dump_addr, st)
+    ) {
+        /* request everything as if nothing was there */
+        st = nl_state{};
+        return;
+    }
+    st.known = true;
+}
+
+/* wait for the acks of all requests; false if the socket fails */
+static bool nl_acks(int fd, std::vector<nl_req> &reqs) {
+    alignas(struct nlmsghdr) char rbuf[8192];
+    std::size_t left = reqs.size();
+    while (left) {
+        auto ret = recv(fd, rbuf, sizeof(rbuf), 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        auto len = std::size_t(ret);
+        for (
+            auto *nh = reinterpret_cast<struct nlmsghdr *>(rbuf);
+            NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)
+        ) {
+            if (nh->nlmsg_type != NLMSG_ERROR) {
+                continue;
+            }
+            if ((nh->nlmsg_seq < 1) || (nh->nlmsg_seq > reqs.size())) {
+                continue;
+            }
+            auto *nerr = static_cast<struct nlmsgerr *>(NLMSG_DATA(nh));
+            auto &req = reqs[nh->nlmsg_seq - 1];
+            if (req.error < 0) {
+                req.error = -nerr->error;
+                --left;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int, char **) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        /* no rtnetlink, at least bring up the link */
+        return lo_ioctl();
+    }
+
+    std::vector<char> buf;
+    std::vector<nl_req> reqs;
+    nl_state st;
+
+    nl_query(fd, st);
+
+    /* link first, so the addresses the kernel adds with it are there */
+    if (!st.lo_up) {
+        add_link(buf, reqs, "lo");
+    }
+
+    struct in_addr a4;
+    a4.s_addr = htonl(INADDR_LOOPBACK);
+    if (!st.have4) {
+        add_addr(buf, reqs, AF_INET, &a4, sizeof(a4), 8);
+    }
+    if (!st.have6) {
+        add_addr(
+            buf, reqs, AF_INET6, &in6addr_loopback, sizeof(in6_addr), 128
+        );
+    }
+
+    load_links(buf, reqs, st);
+
+    if (reqs.empty()) {
+        /* everything is already set up */
+        close(fd);
+        return 0;
+    }
+
+    struct sockaddr_nl snl{};
+    snl.nl_family = AF_NETLINK;
+    if (sendto(
+        fd, buf.data(), buf.size(), 0,
+        reinterpret_cast<struct sockaddr *>(&snl), sizeof(snl)
+    ) < 0) {
+        close(fd);
+        return lo_ioctl();
+    }
+
+    if (!nl_acks(fd, reqs)) {
+        err(1, "could not read rtnetlink replies");
+    }
+    close(fd);
+
+    int ret = 0;
+    for (auto &req: reqs) {
+        if (!req.error) {
+            continue;
+        }
+        errno = req.error;
+        switch (req.kind) {
+            case REQ_LINK:
+                warn("could not bring up '%s'", req.ifname.data());
+                /* other interfaces are best effort */
+                if (req.ifname == "lo") {
+                    ret = 1;
+                }
+                break;
+            case REQ_ADDR4:
+                if (req.error != EEXIST) {
+                    warn("could not add 127.0.0.1/8 to 'lo'");
+                    /* no CAP_NET_ADMIN, e.g. in a container; leave it be */
+                    if (req.error != EPERM) {
+                        ret = 1;
+                    }
+                }
+                break;
+            case REQ_ADDR6:
+                /* ipv6 may be disabled or unavailable */
+                if (
+                    (req.error != EEXIST) && (req.error != EPERM) &&
+                    (req.error != EACCES) &&
+                    (req.error != EAFNOSUPPORT) && (req.error != EOPNOTSUPP)
+                ) {
+                    warn("could not add ::1/128 to 'lo'");
+                }
+                break;
+        }
+    }
+
+    return ret;
+}
@@ -31,18 +31,36 @@
 #define _GNU_SOURCE
 #endif
 
+#include <cctype>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <mntent.h>
 #include <err.h>
+#include <fcntl.h>
 #include <grp.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/mount.h>
+#include <sys/random.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
+#ifndef STATX_ATTR_MOUNT_ROOT
+#define STATX_ATTR_MOUNT_ROOT 0x00002000
+#endif
+
 /* fallback; not accurate but good enough for early boot */
 static int mntpt_noproc(char const *inpath, struct stat *st) {
     dev_t sdev;
@@ -88,6 +106,15 @@ static int do_is(char const *mntpt) {
         return 1;
     }
 
+    /* the kernel knows directly (linux 5.8+), so don't scan the table */
+    struct statx stx;
+    if (
+        !statx(AT_FDCWD, mntpt, 0, STATX_TYPE, &stx) &&
+        (stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT)
+    ) {
+        return !(stx.stx_attributes & STATX_ATTR_MOUNT_ROOT);
+    }
+
     sf = setmntent("/proc/self/mounts", "r");
     if (!sf) {
         return mntpt_noproc(mntpt, &st);
@@ -120,7 +147,8 @@ struct mntopt {
     bool invert;
 };
 
-static mntopt known_opts[] = {
+/* must be kept sorted, this is verified at compile time */
+static constexpr mntopt known_opts[] = {
     {"async", MS_SYNCHRONOUS, MS_SYNCHRONOUS, true},
     {"atime", MS_AMASK, MS_NOATIME, true},
     {"bind", MS_TMASK, MS_BIND, false},
@@ -154,8 +182,8 @@ static mntopt known_opts[] = {
     {"rslave", MS_SLAVE, MS_SLAVE | MS_REC, false},
     {"runbindable", MS_UNBINDABLE, MS_UNBINDABLE | MS_REC, false},
     {"rw", MS_RDONLY, MS_RDONLY, true},
-    {"silent", MS_SILENT, MS_SILENT, false},
     {"shared", MS_SHARED, MS_SHARED, false},
+    {"silent", MS_SILENT, MS_SILENT, false},
     {"slave", MS_SLAVE, MS_SLAVE, false},
     {"strictatime", MS_STRICTATIME, MS_STRICTATIME, false},
     {"suid", MS_NOSUID, MS_NOSUID, true},
@@ -164,6 +192,60 @@ static mntopt known_opts[] = {
     {"unbindable", MS_UNBINDABLE, MS_UNBINDABLE, false},
 };
 
+static constexpr std::size_t known_nopts = sizeof(known_opts) / sizeof(mntopt);
+
+static constexpr int opt_cmp(char const *a, char const *b) {
+    for (; *a && (*a == *b); ++a, ++b) {}
+    return int(static_cast<unsigned char>(*a)) -
+        int(static_cast<unsigned char>(*b));
+}
+
+static constexpr bool known_opts_sorted() {
+    for (std::size_t i = 1; i < known_nopts; ++i) {
+        if (opt_cmp(known_opts[i - 1].name, known_opts[i].name) >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(known_opts_sorted(), "known_opts must be sorted by name");
+
+static constexpr mntopt const *find_opt(char const *name) {
+    std::size_t lo = 0, hi = known_nopts;
+    while (lo < hi) {
+        auto mid = (lo + hi) / 2;
+        auto cmpv = opt_cmp(name, known_opts[mid].name);
+        if (cmpv == 0) {
+            return &known_opts[mid];
+        } else if (cmpv < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return nullptr;
+}
+
+/* the search must find exactly what a linear scan of the table finds */
+static constexpr bool find_opt_matches_linear() {
+    for (std::size_t i = 0; i < known_nopts; ++i) {
+        if (find_opt(known_opts[i].name) != &known_opts[i]) {
+            return false;
+        }
+    }
+    /* below, above, between and prefixes of known names */
+    char const *unknown[] = {"", "a", "zzz", "defaults", "no", "r", "sy"};
+    for (auto *u: unknown) {
+        if (find_opt(u)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(find_opt_matches_linear(), "find_opt must agree with the table");
+
 static unsigned long parse_mntopts(
     char *opts, unsigned long flags, std::string &eopts
 ) {
@@ -174,21 +256,13 @@ static unsigned long parse_mntopts(
         if (!optn[0]) {
             continue;
         }
-        mntopt *optv = nullptr;
-        for (size_t i = 0; i < (sizeof(known_opts) / sizeof(mntopt)); ++i) {
-            auto cmpv = std::strcmp(optn, known_opts[i].name);
-            if (cmpv == 0) {
-                optv = &known_opts[i];
-                flags &= ~optv->flagmask;
-                if (optv->invert) {
-                    flags &= ~optv->flagset;
-                } else {
-                    flags |= optv->flagset;
-                }
-                break;
-            } else if (cmpv < 0) {
-                /* no point in searching further */
-                break;
+        auto *optv = find_opt(optn);
+        if (optv) {
+            flags &= ~optv->flagmask;
+            if (optv->invert) {
+                flags &= ~optv->flagset;
+            } else {
+                flags |= optv->flagset;
             }
         }
         if (!optv && !std::strcmp(optn, "defaults")) {
@@ -209,7 +283,7 @@ static unsigned long parse_mntopts(
 
 static std::string unparse_mntopts(unsigned long flags, std::string const &eopts) {
     std::string ret{};
-    for (size_t i = 0; i < (sizeof(known_opts) / sizeof(mntopt)); ++i) {
+    for (size_t i = 0; i < known_nopts; ++i) {
         auto &ko = known_opts[i];
         if (ko.invert || !(flags & ko.flagset)) {
             continue;
@@ -288,6 +362,188 @@ static int do_mount_helper(
     return 0;
 }
 
+#if defined(SYS_fsopen) && defined(SYS_move_mount)
+/* new mount api; defined here as libc and header support for it varies */
+static constexpr unsigned int MNTAPI_FSOPEN_CLOEXEC = 0x1;
+static constexpr unsigned int MNTAPI_FSMOUNT_CLOEXEC = 0x1;
+static constexpr unsigned int MNTAPI_SET_FLAG = 0;
+static constexpr unsigned int MNTAPI_SET_STRING = 1;
+static constexpr unsigned int MNTAPI_CMD_CREATE = 6;
+static constexpr unsigned int MNTAPI_MOVE_F_EMPTY_PATH = 0x4;
+
+static constexpr unsigned int MNTAPI_ATTR_RDONLY = 0x1;
+static constexpr unsigned int MNTAPI_ATTR_NOSUID = 0x2;
+static constexpr unsigned int MNTAPI_ATTR_NODEV = 0x4;
+static constexpr unsigned int MNTAPI_ATTR_NOEXEC = 0x8;
+static constexpr unsigned int MNTAPI_ATTR_NOATIME = 0x10;
+static constexpr unsigned int MNTAPI_ATTR_STRICTATIME = 0x20;
+static constexpr unsigned int MNTAPI_ATTR_NODIRATIME = 0x80;
+static constexpr unsigned int MNTAPI_ATTR_NOSYMFOLLOW = 0x200000;
+
+/* keep whatever the kernel had to say about the failure, one per line */
+static void mntapi_log(int fsfd, std::string &log) {
+    char buf[512];
+    for (;;) {
+        auto n = read(fsfd, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        if (buf[n - 1] == '\n') {
+            --n;
+        }
+        /* messages are prefixed with their severity */
+        std::size_t off = ((n > 2) && (buf[1] == ' ')) ? 2 : 0;
+        log.append(&buf[off], n - off);
+        log.push_back('\n');
+    }
+}
+
+/* split at commas outside of quotes, which may hold e.g. selinux contexts */
+static bool mntapi_next_opt(std::string_view &opts, std::string_view &opt) {
+    while (!opts.empty() && (opts[0] == ',')) {
+        opts.remove_prefix(1);
+    }
+    if (opts.empty()) {
+        return false;
+    }
+    bool quoted = false;
+    std::size_t i = 0;
+    for (; i < opts.size(); ++i) {
+        if (opts[i] == '"') {
+            quoted = !quoted;
+        } else if ((opts[i] == ',') && !quoted) {
+            break;
+        }
+    }
+    opt = opts.substr(0, i);
+    opts.remove_prefix(i);
+    return true;
+}
+
+/* mount a new superblock with fsopen/fsconfig/fsmount/move_mount, which
+ * reports errors per option; returns -1 if this cannot be used for the
+ * given mount or fails before anything is attached, in which case the
+ * classic mount(2) is used instead and the kernel messages are left in
+ * the log for when that fails too
+ */
+static int do_mount_api(
+    char const *tgt, char const *src, char const *fstype,
+    unsigned long flags, unsigned long pflags, std::string const &eopts,
+    std::string &log
+) {
+    /* not creating a new superblock, or propagation, which cannot be set
+     * on a detached mount on every kernel with the new api
+     */
+    if ((flags & (MS_TMASK | MS_I_VERSION)) || pflags) {
+        return -1;
+    }
+    int fsfd = syscall(SYS_fsopen, fstype, MNTAPI_FSOPEN_CLOEXEC);
+    if (fsfd < 0) {
+        /* old kernel, filtered syscall, or unknown type */
+        return -1;
+    }
+    auto fsconf = [fsfd](unsigned int cmd, char const *key, char const *val) {
+        return syscall(SYS_fsconfig, fsfd, cmd, key, val, 0);
+    };
+    static struct {
+        unsigned long flag;
+        char const *name;
+    } const sb_flags[] = {
+        {MS_RDONLY, "ro"},
+        {MS_SYNCHRONOUS, "sync"},
+        {MS_DIRSYNC, "dirsync"},
+        {MS_LAZYTIME, "lazytime"},
+        {MS_MANDLOCK, "mand"},
+    };
+    unsigned int attrs = 0;
+    int mfd = -1;
+    std::string_view optv = eopts, opt;
+    if (src && *src && (fsconf(MNTAPI_SET_STRING, "source", src) < 0)) {
+        goto fail;
+    }
+    for (auto &sbf: sb_flags) {
+        if ((flags & sbf.flag) && (fsconf(MNTAPI_SET_FLAG, sbf.name, nullptr) < 0)) {
+            goto fail;
+        }
+    }
+    while (mntapi_next_opt(optv, opt)) {
+        auto eq = opt.find('=');
+        long r;
+        if (eq == std::string_view::npos) {
+            std::string key{opt};
+            r = fsconf(MNTAPI_SET_FLAG, key.data(), nullptr);
+        } else {
+            std::string key{opt.substr(0, eq)};
+            auto val = opt.substr(eq + 1);
+            /* fsconfig takes the value as is, without the quoting */
+            if (
+                (val.size() >= 2) && (val.front() == '"') &&
+                (val.back() == '"')
+            ) {
+                val = val.substr(1, val.size() - 2);
+            }
+            std::string sval{val};
+            r = fsconf(MNTAPI_SET_STRING, key.data(), sval.data());
+        }
+        if (r < 0) {
+            goto fail;
+        }
+    }
+    if (fsconf(MNTAPI_CMD_CREATE, nullptr, nullptr) < 0) {
+        goto fail;
+    }
+    if (flags & MS_RDONLY) {
+        attrs |= MNTAPI_ATTR_RDONLY;
+    }
+    if (flags & MS_NOSUID) {
+        attrs |= MNTAPI_ATTR_NOSUID;
+    }
+    if (flags & MS_NODEV) {
+        attrs |= MNTAPI_ATTR_NODEV;
+    }
+    if (flags & MS_NOEXEC) {
+        attrs |= MNTAPI_ATTR_NOEXEC;
+    }
+    if (flags & MS_NODIRATIME) {
+        attrs |= MNTAPI_ATTR_NODIRATIME;
+    }
+    if (flags & MS_NOSYMFOLLOW) {
+        attrs |= MNTAPI_ATTR_NOSYMFOLLOW;
+    }
+    /* relatime is the default like with mount(2) */
+    if (flags & MS_NOATIME) {
+        attrs |= MNTAPI_ATTR_NOATIME;
+    } else if (flags & MS_STRICTATIME) {
+        attrs |= MNTAPI_ATTR_STRICTATIME;
+    }
+    mfd = syscall(SYS_fsmount, fsfd, MNTAPI_FSMOUNT_CLOEXEC, attrs);
+    if (mfd < 0) {
+        goto fail;
+    }
+    close(fsfd);
+    /* this is the only step that makes the mount visible */
+    if (syscall(
+        SYS_move_mount, mfd, "", AT_FDCWD, tgt, MNTAPI_MOVE_F_EMPTY_PATH
+    ) < 0) {
+        close(mfd);
+        return -1;
+    }
+    close(mfd);
+    return 0;
+fail:
+    mntapi_log(fsfd, log);
+    close(fsfd);
+    return -1;
+}
+#else
+static int do_mount_api(
+    char const *, char const *, char const *,
+    unsigned long, unsigned long, std::string const &, std::string &
+) {
+    return -1;
+}
+#endif
+
 static int do_mount_raw(
     char const *tgt, char const *src, char const *fstype,
     unsigned long flags, std::string &eopts, bool helper = false
@@ -306,11 +562,26 @@ static int do_mount_raw(
             return hret;
         }
     }
+    std::string log;
+    auto aret = do_mount_api(
+        tgt, src, fstype, flags, (pflags & pmask) ? pflags : 0, eopts, log
+    );
+    if (aret >= 0) {
+        return aret;
+    }
     if (mount(src, tgt, fstype, flags, eopts.data()) < 0) {
         int serrno = errno;
         /* try a helper if regular mount fails */
         int ret = do_mount_helper(tgt, src, fstype, flags, eopts);
         if (ret < 0) {
+            /* the new api may have said more about what is wrong */
+            std::string_view lv = log;
+            while (!lv.empty()) {
+                auto nl = lv.find('\n');
+                auto ln = lv.substr(0, nl);
+                warnx("%.*s", int(ln.size()), ln.data());
+                lv.remove_prefix(ln.size() + (nl != std::string_view::npos));
+            }
             errno = serrno;
             warn("failed to mount filesystem '%s'", tgt);
             return 1;
@@ -547,6 +818,927 @@ static int do_getent(char const *tab, const char *mntpt, char const *ent) {
     return 0;
 }
 
+struct query_ent {
+    std::string fsname;
+    std::string type;
+    std::string opts;
+    int freq;
+    int passno;
+};
+
+/* each table is parsed at most once per batch */
+using query_tab = std::unordered_map<std::string, query_ent>;
+
+static query_tab *query_load(
+    std::unordered_map<std::string, query_tab> &tabs, char const *tab
+) {
+    auto it = tabs.find(tab);
+    if (it != tabs.end()) {
+        return &it->second;
+    }
+    FILE *sf = setmntent(tab, "r");
+    if (!sf) {
+        warn("could not open '%s'", tab);
+        return nullptr;
+    }
+    auto &qt = tabs[tab];
+    for (struct mntent *mn; (mn = getmntent(sf));) {
+        /* later entries win, like the topmost mount */
+        qt[mn->mnt_dir] = query_ent{
+            mn->mnt_fsname, mn->mnt_type, mn->mnt_opts,
+            mn->mnt_freq, mn->mnt_passno
+        };
+    }
+    endmntent(sf);
+    return &qt;
+}
+
+/* answers one query per output line, in order; 'is' prints yes or no,
+ * 'getent' prints the field or an empty line, so the output can be
+ * consumed with a series of read calls in shell
+ */
+static int query_run(
+    std::unordered_map<std::string, query_tab> &tabs,
+    std::vector<char *> &args, std::size_t &idx
+) {
+    auto need = [&args, &idx](std::size_t n) {
+        if ((args.size() - idx) < n) {
+            warnx("incomplete query '%s'", args[idx - 1]);
+            idx = args.size();
+            return false;
+        }
+        return true;
+    };
+    char const *cmd = args[idx++];
+    if (!std::strcmp(cmd, "is")) {
+        if (!need(1)) {
+            printf("\n");
+            return 1;
+        }
+        printf("%s\n", do_is(args[idx++]) ? "no" : "yes");
+        return 0;
+    } else if (!std::strcmp(cmd, "getent")) {
+        if (!need(3)) {
+            printf("\n");
+            return 1;
+        }
+        char const *tab = args[idx++];
+        char const *mntpt = args[idx++];
+        char const *ent = args[idx++];
+        auto *qt = query_load(tabs, tab);
+        if (!qt) {
+            printf("\n");
+            return 1;
+        }
+        auto it = qt->find(mntpt);
+        if (it == qt->end()) {
+            printf("\n");
+            return 0;
+        }
+        auto &qe = it->second;
+        if (!std::strcmp(ent, "fsname")) {
+            printf("%s\n", qe.fsname.data());
+        } else if (!std::strcmp(ent, "type")) {
+            printf("%s\n", qe.type.data());
+        } else if (!std::strcmp(ent, "opts")) {
+            printf("%s\n", qe.opts.data());
+        } else if (!std::strcmp(ent, "freq")) {
+            printf("%d\n", qe.freq);
+        } else if (!std::strcmp(ent, "passno")) {
+            printf("%d\n", qe.passno);
+        } else {
+            warnx("invalid field '%s'", ent);
+            printf("\n");
+            return 1;
+        }
+        return 0;
+    }
+    warnx("unknown query '%s'", cmd);
+    printf("\n");
+    return 1;
+}
+
+static int do_query(int argc, char **argv) {
+    std::unordered_map<std::string, query_tab> tabs;
+    std::vector<char *> args;
+    char *line = nullptr;
+    int ret = 0;
+    if (argc > 0) {
+        /* a flat list of queries on the command line */
+        args.assign(argv, argv + argc);
+        for (std::size_t idx = 0; idx < args.size();) {
+            ret |= query_run(tabs, args, idx);
+        }
+        return ret;
+    }
+    /* one whitespace-separated query per line */
+    std::size_t lsize = 0;
+    while (getline(&line, &lsize, stdin) > 0) {
+        args.clear();
+        char *sp = line;
+        for (char *tok; (tok = strsep(&sp, " \t\n"));) {
+            if (*tok) {
+                args.push_back(tok);
+            }
+        }
+        if (args.empty()) {
+            continue;
+        }
+        std::size_t idx = 0;
+        ret |= query_run(tabs, args, idx);
+        if (idx != args.size()) {
+            warnx("trailing arguments in query '%s'", args[0]);
+            ret = 1;
+        }
+        fflush(stdout);
+    }
+    std::free(line);
+    return ret;
+}
+
+/* whether the path is the same as or lies under the mountpoint */
+static bool path_under(std::string_view path, std::string_view mntpt) {
+    if (mntpt == "/") {
+        return (path[0] == '/');
+    }
+    if (path.compare(0, mntpt.size(), mntpt)) {
+        return false;
+    }
+    return (path.size() == mntpt.size()) || (path[mntpt.size()] == '/');
+}
+
+struct fstab_ent {
+    std::string fsname;
+    std::string dir;
+    std::string type;
+    std::string opts;
+    /* other paths this mount needs to be reachable */
+    std::vector<std::string> srcs;
+    /* earlier entries that have to be mounted first */
+    std::vector<std::size_t> deps;
+    pid_t pid = 0;
+    bool nofail = false;
+    bool started = false;
+    bool done = false;
+    int ret = 0;
+};
+
+static void fstab_add_srcs(fstab_ent &ent, struct mntent *mn) {
+    if (hasmntopt(mn, "bind") || hasmntopt(mn, "rbind")) {
+        ent.srcs.push_back(ent.fsname);
+    }
+    if (ent.type != "overlay") {
+        return;
+    }
+    std::string_view sv = ent.opts;
+    while (!sv.empty()) {
+        auto sep = sv.find(',');
+        auto opt = sv.substr(0, sep);
+        sv = (sep == std::string_view::npos) ? "" : sv.substr(sep + 1);
+        if (!opt.compare(0, 9, "lowerdir=")) {
+            /* a list of layers */
+            opt.remove_prefix(9);
+            while (!opt.empty()) {
+                auto col = opt.find(':');
+                if (opt[0] == '/') {
+                    ent.srcs.emplace_back(opt.substr(0, col));
+                }
+                opt = (col == std::string_view::npos) ? "" : opt.substr(col + 1);
+            }
+        } else if (
+            !opt.compare(0, 9, "upperdir=") || !opt.compare(0, 8, "workdir=")
+        ) {
+            opt.remove_prefix(opt.find('=') + 1);
+            if (!opt.empty() && (opt[0] == '/')) {
+                ent.srcs.emplace_back(opt);
+            }
+        }
+    }
+}
+
+/* every entry goes through mount(8), which knows about loop devices, tags,
+ * external helpers and userspace-only options; we only do the ordering
+ */
+static pid_t fstab_spawn(fstab_ent const &ent) {
+    auto cpid = fork();
+    if (cpid == 0) {
+        execlp(
+            "mount", "mount", "-t", ent.type.data(), "-o", ent.opts.data(),
+            ent.fsname.data(), ent.dir.data(), nullptr
+        );
+        _exit(127);
+    } else if (cpid < 0) {
+        warn("fork failed");
+    }
+    return cpid;
+}
+
+static int do_fstab_start() {
+    /* same as mount -a -t nosysfs,nonfs,nonfs4,nosmbfs,nocifs -O no_netdev */
+    static char const *skip_types[] = {
+        "sysfs", "nfs", "nfs4", "smbfs", "cifs", "swap", "ignore", nullptr
+    };
+    std::vector<fstab_ent> ents;
+    FILE *sf = setmntent("/etc/fstab", "r");
+    if (!sf) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        warn("could not open fstab");
+        return 1;
+    }
+    for (struct mntent *mn; (mn = getmntent(sf));) {
+        bool skip = false;
+        for (char const **p = skip_types; *p; ++p) {
+            if (!std::strcmp(mn->mnt_type, *p)) {
+                skip = true;
+                break;
+            }
+        }
+        if (
+            skip || hasmntopt(mn, "noauto") || hasmntopt(mn, "_netdev") ||
+            (mn->mnt_dir[0] != '/') || !std::strcmp(mn->mnt_dir, "/")
+        ) {
+            continue;
+        }
+        auto &ent = ents.emplace_back();
+        ent.fsname = mn->mnt_fsname;
+        ent.dir = mn->mnt_dir;
+        ent.type = mn->mnt_type;
+        ent.opts = mn->mnt_opts;
+        ent.nofail = hasmntopt(mn, "nofail");
+        fstab_add_srcs(ent, mn);
+    }
+    endmntent(sf);
+    /* entries depend on earlier ones they are nested in or that are nested
+     * in them, so the stacking is the same as with sequential mounting, as
+     * well as the ones their sources are located in; the rest is independent
+     */
+    for (std::size_t j = 0; j < ents.size(); ++j) {
+        auto &ej = ents[j];
+        for (std::size_t i = 0; i < j; ++i) {
+            auto &ei = ents[i];
+            bool dep = path_under(ej.dir, ei.dir) || path_under(ei.dir, ej.dir);
+            for (auto it = ej.srcs.begin(); !dep && (it != ej.srcs.end()); ++it) {
+                dep = path_under(*it, ei.dir);
+            }
+            if (dep) {
+                ej.deps.push_back(i);
+            }
+        }
+    }
+    /* mount everything as soon as its dependencies are done */
+    std::size_t running = 0;
+    for (;;) {
+        for (auto &ent: ents) {
+            if (ent.started) {
+                continue;
+            }
+            bool ready = true;
+            for (auto d: ent.deps) {
+                if (!ents[d].done) {
+                    ready = false;
+                    break;
+                }
+            }
+            if (!ready) {
+                continue;
+            }
+            ent.started = true;
+            /* already mounted, like mount -a would skip it */
+            if (do_is(ent.dir.data()) == 0) {
+                ent.done = true;
+                continue;
+            }
+            ent.pid = fstab_spawn(ent);
+            if (ent.pid < 0) {
+                ent.ret = 1;
+                ent.done = true;
+                continue;
+            }
+            ++running;
+        }
+        if (!running) {
+            /* an entry may have been completed without a child */
+            bool all = true;
+            for (auto &ent: ents) {
+                if (!ent.started) {
+                    all = false;
+                    break;
+                }
+            }
+            if (all) {
+                break;
+            }
+            continue;
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            warn("waitpid failed");
+            return 1;
+        }
+        for (auto &ent: ents) {
+            if (ent.started && !ent.done && (ent.pid == pid)) {
+                ent.ret = !WIFEXITED(status) || WEXITSTATUS(status);
+                ent.done = true;
+                --running;
+                break;
+            }
+        }
+    }
+    int ret = 0;
+    for (auto &ent: ents) {
+        if (ent.ret && !ent.nofail) {
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+/* umount -t style type list, each entry may be negated with a no prefix */
+static bool match_fstype(char const *list, std::string_view type) {
+    if (!list) {
+        return true;
+    }
+    bool has_pos = false;
+    std::string_view sv = list;
+    while (!sv.empty()) {
+        auto sep = sv.find(',');
+        auto item = sv.substr(0, sep);
+        sv = (sep == std::string_view::npos) ? "" : sv.substr(sep + 1);
+        if (!item.compare(0, 2, "no")) {
+            if (item.substr(2) == type) {
+                return false;
+            }
+        } else {
+            if (item == type) {
+                return true;
+            }
+            has_pos = true;
+        }
+    }
+    return !has_pos;
+}
+
+/* mountinfo escapes whitespace and backslashes as octal */
+static std::string unescape_mntpath(std::string_view sv) {
+    std::string ret;
+    ret.reserve(sv.size());
+    for (std::size_t i = 0; i < sv.size(); ++i) {
+        if (
+            (sv[i] == '\\') && (i + 3 < sv.size()) &&
+            (sv[i + 1] >= '0') && (sv[i + 1] <= '3') &&
+            (sv[i + 2] >= '0') && (sv[i + 2] <= '7') &&
+            (sv[i + 3] >= '0') && (sv[i + 3] <= '7')
+        ) {
+            ret.push_back(char(
+                ((sv[i + 1] - '0') << 6) | ((sv[i + 2] - '0') << 3) |
+                (sv[i + 3] - '0')
+            ));
+            i += 3;
+        } else {
+            ret.push_back(sv[i]);
+        }
+    }
+    return ret;
+}
+
+struct umnt_ent {
+    std::string dir;
+    std::string opts;
+    std::size_t parent = SIZE_MAX;
+    /* number of submounts that have not been processed yet */
+    std::size_t pending = 0;
+    bool skip = false;
+};
+
+/* calls cb with the first six fields (id parent maj:min root mntpt opts),
+ * the filesystem type and the superblock options of each mount
+ */
+template<typename F>
+static bool scan_mountinfo(F &&cb) {
+    FILE *f = std::fopen("/proc/self/mountinfo", "r");
+    if (!f) {
+        warn("could not open mountinfo");
+        return false;
+    }
+    char *line = nullptr;
+    std::size_t lsize = 0;
+    for (ssize_t nread; (nread = getline(&line, &lsize, f)) > 0;) {
+        /* id parent maj:min root mntpt opts [optional...] - type src sopts */
+        std::string_view fields[6];
+        std::string_view sv{line, std::size_t(nread)};
+        if (sv.back() == '\n') {
+            sv.remove_suffix(1);
+        }
+        std::size_t nf = 0;
+        for (; nf < 6; ++nf) {
+            auto sep = sv.find(' ');
+            fields[nf] = sv.substr(0, sep);
+            if (sep == std::string_view::npos) {
+                sv = "";
+                ++nf;
+                break;
+            }
+            sv = sv.substr(sep + 1);
+        }
+        auto dash = sv.find("- ");
+        while ((dash != std::string_view::npos) && dash && (sv[dash - 1] != ' ')) {
+            dash = sv.find("- ", dash + 1);
+        }
+        if ((nf < 6) || (dash == std::string_view::npos)) {
+            continue;
+        }
+        sv = sv.substr(dash + 2);
+        auto type = sv.substr(0, sv.find(' '));
+        /* skip the type and the source */
+        std::string_view sopts;
+        auto sep = sv.find(' ');
+        if (sep != std::string_view::npos) {
+            sep = sv.find(' ', sep + 1);
+            if (sep != std::string_view::npos) {
+                sopts = sv.substr(sep + 1);
+            }
+        }
+        cb(fields, type, sopts);
+    }
+    std::free(line);
+    std::fclose(f);
+    return true;
+}
+
+/* mountpoints marked _netdev in fstab, which the mount table does not say */
+static void read_netdev(std::vector<std::string> &dirs) {
+    FILE *sf = setmntent("/etc/fstab", "r");
+    if (!sf) {
+        return;
+    }
+    for (struct mntent *mn; (mn = getmntent(sf));) {
+        if (hasmntopt(mn, "_netdev")) {
+            dirs.emplace_back(mn->mnt_dir);
+        }
+    }
+    endmntent(sf);
+}
+
+static bool read_mountinfo(
+    std::vector<umnt_ent> &ents, char const *types, bool netdev
+) {
+    std::unordered_map<unsigned long, std::size_t> ids;
+    std::vector<unsigned long> pids;
+    std::vector<std::string> ndirs;
+    if (netdev) {
+        read_netdev(ndirs);
+    }
+    bool ret = scan_mountinfo([&](
+        std::string_view const *fields, std::string_view type, std::string_view
+    ) {
+        auto &ent = ents.emplace_back();
+        ent.dir = unescape_mntpath(fields[4]);
+        ent.opts = fields[5];
+        ent.skip = (ent.dir == "/") || !match_fstype(types, type);
+        if (netdev && !ent.skip) {
+            ent.skip = std::find(
+                ndirs.begin(), ndirs.end(), ent.dir
+            ) == ndirs.end();
+        }
+        ids.emplace(std::strtoul(fields[0].data(), nullptr, 10), ents.size() - 1);
+        pids.push_back(std::strtoul(fields[1].data(), nullptr, 10));
+    });
+    if (!ret) {
+        return false;
+    }
+    for (std::size_t i = 0; i < ents.size(); ++i) {
+        auto it = ids.find(pids[i]);
+        if ((it != ids.end()) && (it->second != i)) {
+            ents[i].parent = it->second;
+            ++ents[it->second].pending;
+        }
+    }
+    return true;
+}
+
+static double ms_since(struct timespec const &ts) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return double(now.tv_sec - ts.tv_sec) * 1000.0 +
+        double(now.tv_nsec - ts.tv_nsec) / 1000000.0;
+}
+
+/* -1 on failure, 0 when unmounted, 1 when remounted read-only */
+static int umount_one(umnt_ent &ent, bool lazy) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (umount2(ent.dir.data(), lazy ? MNT_DETACH : 0) == 0) {
+        printf("unmounted %s (%.1f ms)\n", ent.dir.data(), ms_since(ts));
+        return 0;
+    }
+    if (lazy || (errno != EBUSY)) {
+        warn("could not unmount '%s'", ent.dir.data());
+        return -1;
+    }
+    /* still in use, at least make it read-only like umount -r */
+    std::string eopts;
+    unsigned long flags = parse_mntopts(
+        ent.opts.data(), MS_SILENT | MS_REMOUNT, eopts
+    );
+    if (mount(nullptr, ent.dir.data(), nullptr, flags | MS_RDONLY, nullptr) < 0) {
+        warn("could not remount '%s' read-only", ent.dir.data());
+        return -1;
+    }
+    printf(
+        "remounted %s read-only (%.1f ms)\n", ent.dir.data(), ms_since(ts)
+    );
+    return 1;
+}
+
+/* flags is a list of lazy (detach instead of unmounting, like umount -l)
+ * and netdev (only what is marked _netdev in fstab, like umount -O netdev)
+ */
+static int do_umount_all(char const *types, char const *flags) {
+    bool lazy = false, netdev = false;
+    for (std::string_view sv = flags ? flags : ""; !sv.empty();) {
+        auto sep = sv.find(',');
+        auto item = sv.substr(0, sep);
+        sv = (sep == std::string_view::npos) ? "" : sv.substr(sep + 1);
+        if (item == "lazy") {
+            lazy = true;
+        } else if (item == "netdev") {
+            netdev = true;
+        } else {
+            warnx("unknown flag '%.*s'", int(item.size()), item.data());
+            return 1;
+        }
+    }
+    std::vector<umnt_ent> ents;
+    if (!read_mountinfo(ents, types, netdev)) {
+        return 1;
+    }
+    std::vector<std::size_t> ready;
+    for (std::size_t i = 0; i < ents.size(); ++i) {
+        if (!ents[i].pending) {
+            ready.push_back(i);
+        }
+    }
+    /* leaves are unmounted first; a mount becomes ready once everything
+     * mounted on top of it has been processed, so sibling subtrees are
+     * unmounted in parallel and the whole thing takes about as long as
+     * the slowest branch
+     */
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::size_t left = ents.size();
+    int ret = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    auto worker = [&]() {
+        std::unique_lock<std::mutex> lk{mtx};
+        for (;;) {
+            cv.wait(lk, [&]() { return !ready.empty() || !left; });
+            if (!left) {
+                return;
+            }
+            auto idx = ready.back();
+            ready.pop_back();
+            auto &ent = ents[idx];
+            int r = 1;
+            if (!ent.skip) {
+                lk.unlock();
+                r = umount_one(ent, lazy);
+                lk.lock();
+                if (r < 0) {
+                    ret = 1;
+                }
+            }
+            --left;
+            /* anything below a mount that stays is only reachable by path
+             * through it, so it must be left alone too
+             */
+            if (r && (ent.parent != SIZE_MAX) && (ents[ent.parent].dir == ent.dir)) {
+                ents[ent.parent].skip = true;
+            }
+            if ((ent.parent != SIZE_MAX) && !--ents[ent.parent].pending) {
+                ready.push_back(ent.parent);
+            }
+            cv.notify_all();
+        }
+    };
+    std::vector<std::thread> thrs;
+    auto nthr = std::min(ents.size(), std::size_t(16));
+    thrs.reserve(nthr);
+    for (std::size_t i = 0; i < nthr; ++i) {
+        thrs.emplace_back(worker);
+    }
+    for (auto &thr: thrs) {
+        thr.join();
+    }
+    printf("unmounting done (%.1f ms)\n", ms_since(ts));
+    return ret;
+}
+
+static bool has_opt(std::string_view opts, std::string_view opt) {
+    while (!opts.empty()) {
+        auto sep = opts.find(',');
+        if (opts.substr(0, sep) == opt) {
+            return true;
+        }
+        opts = (sep == std::string_view::npos) ? "" : opts.substr(sep + 1);
+    }
+    return false;
+}
+
+static int do_syncall(char const *tmout) {
+    /* nothing to write back on these */
+    static char const *skip_types[] = {
+        "autofs", "binfmt_misc", "bpf", "cgroup", "cgroup2", "configfs",
+        "debugfs", "devpts", "devtmpfs", "efivarfs", "fusectl", "hugetlbfs",
+        "mqueue", "nsfs", "proc", "pstore", "ramfs", "rpc_pipefs",
+        "securityfs", "sysfs", "tmpfs", "tracefs", nullptr
+    };
+    unsigned long secs = 30;
+    if (tmout) {
+        char *end = nullptr;
+        errno = 0;
+        secs = std::strtoul(tmout, &end, 10);
+        /* zero would abandon everything before it even got started */
+        if (
+            !std::isdigit(static_cast<unsigned char>(*tmout)) || *end ||
+            (errno == ERANGE) || !secs
+        ) {
+            errx(1, "invalid timeout '%s'", tmout);
+        }
+        /* nothing should take longer than this, and it keeps the
+         * millisecond arithmetic below well within range
+         */
+        if (secs > 3600) {
+            secs = 3600;
+        }
+    }
+    std::vector<std::string> devs;
+    std::vector<std::string> dirs;
+    bool ok = scan_mountinfo([&](
+        std::string_view const *fields, std::string_view type,
+        std::string_view sopts
+    ) {
+        for (char const **p = skip_types; *p; ++p) {
+            if (type == *p) {
+                return;
+            }
+        }
+        if (has_opt(fields[5], "ro") || has_opt(sopts, "ro")) {
+            return;
+        }
+        /* one syncfs per superblock is enough */
+        for (auto &dev: devs) {
+            if (dev == fields[2]) {
+                return;
+            }
+        }
+        devs.emplace_back(fields[2]);
+        dirs.push_back(unescape_mntpath(fields[4]));
+    });
+    if (!ok) {
+        sync();
+        return 1;
+    }
+    sigset_t mask, omask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &omask);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    fflush(stdout);
+    /* every superblock is synced in its own process, so that flushing
+     * overlaps across devices, and one that is stuck in the kernel can
+     * be abandoned without holding up the others or us
+     */
+    std::vector<pid_t> pids(dirs.size(), -1);
+    std::size_t left = 0;
+    int ret = 0;
+    for (std::size_t i = 0; i < dirs.size(); ++i) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            warn("fork failed for '%s'", dirs[i].data());
+            ret = 1;
+            continue;
+        }
+        if (pid == 0) {
+            int fd = open(dirs[i].data(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            if ((fd < 0) || (syncfs(fd) < 0)) {
+                warn("could not sync '%s'", dirs[i].data());
+                _exit(1);
+            }
+            _exit(0);
+        }
+        pids[i] = pid;
+        ++left;
+    }
+    while (left) {
+        double wait_ms = secs * 1000.0 - ms_since(ts);
+        if (wait_ms <= 0) {
+            break;
+        }
+        struct timespec wts;
+        wts.tv_sec = time_t(wait_ms / 1000);
+        wts.tv_nsec = long((wait_ms - wts.tv_sec * 1000.0) * 1000000.0);
+        sigtimedwait(&mask, nullptr, &wts);
+        for (;;) {
+            int status;
+            pid_t pid = waitpid(-1, &status, WNOHANG);
+            if (pid <= 0) {
+                break;
+            }
+            for (std::size_t i = 0; i < pids.size(); ++i) {
+                if (pids[i] != pid) {
+                    continue;
+                }
+                pids[i] = -1;
+                --left;
+                if (WIFEXITED(status) && !WEXITSTATUS(status)) {
+                    printf(
+                        "synced %s (%.1f ms)\n", dirs[i].data(), ms_since(ts)
+                    );
+                } else {
+                    ret = 1;
+                }
+                break;
+            }
+        }
+    }
+    for (std::size_t i = 0; i < pids.size(); ++i) {
+        if (pids[i] > 0) {
+            warnx("timed out syncing '%s'", dirs[i].data());
+            /* goes away on its own once the kernel lets go of it */
+            kill(pids[i], SIGKILL);
+            ret = 1;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &omask, nullptr);
+    printf("syncing done (%.1f ms)\n", ms_since(ts));
+    fflush(stdout);
+    return ret;
+}
+
+#define MACHINE_ID "/etc/machine-id"
+#define RUN_MACHINE_ID "/run/dinit/machine-id"
+
+/* replace the file with the given contents, such that a crash leaves
+ * either the old or the new contents but never anything in between
+ */
+static bool write_atomic(char const *path, std::string_view data) {
+    std::string tmp = path;
+    auto sl = tmp.rfind('/');
+    tmp.insert(sl + 1, ".");
+    tmp += ".XXXXXX";
+    int fd = mkostemp(tmp.data(), O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = (write(fd, data.data(), data.size()) == ssize_t(data.size()));
+    ok = ok && !fchmod(fd, 0644) && !fsync(fd);
+    close(fd);
+    if (!ok || (rename(tmp.data(), path) < 0)) {
+        int serr = errno;
+        unlink(tmp.data());
+        errno = serr;
+        return false;
+    }
+    /* make the rename itself durable */
+    std::string dir{path, sl ? sl : 1};
+    int dfd = open(dir.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+    return true;
+}
+
+/* a file that is bind-mounted over or a symlink (both common for the
+ * machine-id in containers) cannot be renamed over, so rewrite it
+ */
+static bool write_inplace(char const *path, std::string_view data) {
+    int fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = (write(fd, data.data(), data.size()) == ssize_t(data.size()));
+    ok = !fsync(fd) && ok;
+    int serr = errno;
+    close(fd);
+    errno = serr;
+    return ok;
+}
+
+static bool write_id(char const *path, std::string_view data) {
+    struct stat st;
+    if (!lstat(path, &st) && (S_ISLNK(st.st_mode) || !do_is(path))) {
+        return write_inplace(path, data);
+    }
+    return write_atomic(path, data);
+}
+
+static bool read_small(char const *path, std::string &out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    char buf[128];
+    auto ret = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (ret < 0) {
+        return false;
+    }
+    out.assign(buf, ret);
+    return true;
+}
+
+static int machine_id_setup() {
+    std::string cur;
+    bool have = read_small(MACHINE_ID, cur);
+    /* first boot or empty machine-id; generate something we can use */
+    if (
+        !have || cur.empty() || !cur.compare(0, 13, "uninitialized") ||
+        !access("/run/dinit/first-boot", F_OK)
+    ) {
+        unsigned char id[16];
+        if (getrandom(id, sizeof(id), 0) != sizeof(id)) {
+            warn("could not generate machine-id");
+            return 1;
+        }
+        /* formatted as a v4 uuid like everybody else does */
+        id[6] = (id[6] & 0x0F) | 0x40;
+        id[8] = (id[8] & 0x3F) | 0x80;
+        char hex[34];
+        for (std::size_t i = 0; i < sizeof(id); ++i) {
+            std::snprintf(&hex[i * 2], 3, "%02x", id[i]);
+        }
+        hex[32] = '\n';
+        hex[33] = '\0';
+        if (!write_atomic(RUN_MACHINE_ID, std::string_view{hex, 33})) {
+            warn("could not write '%s'", RUN_MACHINE_ID);
+            return 1;
+        }
+    }
+    /* missing machine-id and writable fs; set to uninitialized */
+    if (!have && (access(MACHINE_ID, F_OK) < 0)) {
+        have = write_atomic(MACHINE_ID, "uninitialized\n");
+    }
+    /* if we generated one, bind-mount it over the real file */
+    if (!have || (access(RUN_MACHINE_ID, F_OK) < 0)) {
+        return 0;
+    }
+    /* containers can't mount but might have a mutable fs */
+    char const *cont = std::getenv("DINIT_CONTAINER");
+    if (cont && *cont) {
+        std::string id;
+        if (!read_small(RUN_MACHINE_ID, id)) {
+            warn("could not read '%s'", RUN_MACHINE_ID);
+        } else if (!write_id(MACHINE_ID, id)) {
+            warn("could not write '%s'", MACHINE_ID);
+        }
+        return 0;
+    }
+    char opts[] = "bind";
+    return do_mount(MACHINE_ID, RUN_MACHINE_ID, "none", opts);
+}
+
+static int machine_id_commit() {
+    /* was never bind-mounted */
+    if (do_is(MACHINE_ID)) {
+        return 0;
+    }
+    /* no generated machine-id */
+    std::string id;
+    if (!read_small(RUN_MACHINE_ID, id)) {
+        return 0;
+    }
+    if (umount2(MACHINE_ID, 0) < 0) {
+        warn("could not unmount '%s'", MACHINE_ID);
+        return 1;
+    }
+    if (write_id(MACHINE_ID, id)) {
+        return 0;
+    }
+    warn("could not write '%s'", MACHINE_ID);
+    /* failed to write, bind it again */
+    char opts[] = "bind";
+    return do_mount(MACHINE_ID, RUN_MACHINE_ID, "none", opts);
+}
+
+static int do_machine_id(char const *cmd) {
+    umask(022);
+    if (!std::strcmp(cmd, "setup")) {
+        return machine_id_setup();
+    } else if (!std::strcmp(cmd, "commit")) {
+        return machine_id_commit();
+    }
+    errx(1, "unknown machine-id command '%s'", cmd);
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
         errx(1, "not enough arguments");
@@ -587,6 +1779,30 @@ int main(int argc, char **argv) {
             errx(1, "incorrect number of arguments");
         }
         return do_remount(argv[2], argv[3]);
+    } else if (!std::strcmp(argv[1], "fstab-start")) {
+        if (argc != 2) {
+            errx(1, "incorrect number of arguments");
+        }
+        return do_fstab_start();
+    } else if (!std::strcmp(argv[1], "umount-all")) {
+        if ((argc < 2) || (argc > 4)) {
+            errx(1, "incorrect number of arguments");
+        }
+        return do_umount_all(
+            (argc < 3) ? nullptr : argv[2], (argc < 4) ? nullptr : argv[3]
+        );
+    } else if (!std::strcmp(argv[1], "syncall")) {
+        if ((argc < 2) || (argc > 3)) {
+            errx(1, "incorrect number of arguments");
+        }
+        return do_syncall((argc < 3) ? nullptr : argv[2]);
+    } else if (!std::strcmp(argv[1], "machine-id")) {
+        if (argc != 3) {
+            errx(1, "incorrect number of arguments");
+        }
+        return do_machine_id(argv[2]);
+    } else if (!std::strcmp(argv[1], "query")) {
+        return do_query(argc - 2, argv + 2);
     } else if (!std::strcmp(argv[1], "getent")) {
         if (argc != 5) {
             errx(1, "incorrect number of arguments");
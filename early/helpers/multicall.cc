@@ -0,0 +1,111 @@
+/*
+ * Multi-call helper binary
+ *
+ * When the helpers are built as a single binary, this dispatches to the
+ * right one based on the name it was invoked as, so that the early boot
+ * only needs to load and relocate one image. It may also be invoked with
+ * the helper name as its first argument.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 q66 <q66@chimera-linux.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <cstdio>
+#include <cstring>
+
+/* the helpers get their main renamed to name_main by the build system */
+#define HELPER_LIST \
+    HELPER(binfmt) \
+    HELPER(cgroups) \
+    HELPER(cmdline) \
+    HELPER(devclient) \
+    HELPER(hwclock) \
+    HELPER(swclock) \
+    HELPER(kmod) \
+    HELPER(lo) \
+    HELPER(mnt) \
+    HELPER(seedrng) \
+    HELPER(sysctl) \
+    HELPER(swap) \
+    HELPER(shutdown) \
+    HELPER(trace) \
+    HELPER_DEVMON
+
+#ifdef HAVE_DEVMON
+#define HELPER_DEVMON HELPER(devmon)
+#else
+#define HELPER_DEVMON
+#endif
+
+#define HELPER(name) int name##_main(int argc, char **argv);
+HELPER_LIST
+#undef HELPER
+
+struct helper {
+    char const *name;
+    int (*main)(int, char **);
+};
+
+static helper const helpers[] = {
+#define HELPER(name) {#name, name##_main},
+    HELPER_LIST
+#undef HELPER
+};
+
+static int usage(char const *self) {
+    std::fprintf(stderr, "Usage: %s HELPER [arg]...\n\nHelpers:\n", self);
+    for (auto &h: helpers) {
+        std::fprintf(stderr, "  %s\n", h.name);
+    }
+    return 1;
+}
+
+static helper const *find_helper(char const *name) {
+    for (auto &h: helpers) {
+        if (!std::strcmp(h.name, name)) {
+            return &h;
+        }
+    }
+    return nullptr;
+}
+
+int main(int argc, char **argv) {
+    extern char const *__progname;
+    char const *self = (argc > 0) ? argv[0] : "multicall";
+    char const *base = std::strrchr(self, '/');
+    base = base ? (base + 1) : self;
+    /* invoked through a symlink */
+    auto *h = find_helper(base);
+    if (h) {
+        return h->main(argc, argv);
+    }
+    /* invoked directly with the helper name as argument */
+    if ((argc < 2) || !(h = find_helper(argv[1]))) {
+        return usage(base);
+    }
+    /* the helpers use this for messages, so make it look right */
+    __progname = argv[1];
+    return h->main(argc - 1, argv + 1);
+}
@@ -0,0 +1,394 @@
+/*
+ * Shutdown sequencer
+ *
+ * Runs the final stages of system shutdown, after all services have been
+ * stopped and the remaining processes terminated. Independent stages run
+ * in parallel, each stage has a deadline after which it is abandoned, and
+ * a timing report is printed at the end and saved into pstore if possible.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 q66 <q66@chimera-linux.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#ifndef HELPER_PATH
+#error "HELPER_PATH must be defined"
+#endif
+#ifndef CRYPTDISKS_PATH
+#error "CRYPTDISKS_PATH must be defined"
+#endif
+#ifndef VGCHANGE_PATH
+#error "VGCHANGE_PATH must be defined"
+#endif
+
+#define HELPER(name) HELPER_PATH "/" name
+
+static constexpr int MAX_DEPS = 2;
+
+struct stage {
+    char const *name;
+    char const *msg;
+    char const *argv[6];
+    /* in seconds */
+    unsigned int timeout;
+    /* terminated by -1 if shorter */
+    int deps[MAX_DEPS];
+    /* does not make sense in containers */
+    bool host_only;
+    /* device-mapper teardown without udev */
+    bool no_udev;
+    /* external tool that may not be installed */
+    bool optional;
+    /* run in the stage process before the command; false if there is
+     * nothing to do, which finishes the stage successfully
+     */
+    bool (*pre)();
+};
+
+struct stage_state {
+    pid_t pid;
+    bool started;
+    bool done;
+    bool timed_out;
+    int status;
+    struct timespec start;
+    double ms;
+};
+
+enum {
+    STAGE_SWAP = 0,
+    STAGE_NETFS,
+    STAGE_NETDEV,
+    STAGE_SYNC,
+    STAGE_FS,
+    STAGE_ROOT,
+    STAGE_CRYPT,
+    STAGE_LVM,
+    STAGE_CRYPT_EARLY,
+    STAGE_COUNT,
+};
+
+/* like the old lvm script, only deactivate if there is anything to; this
+ * also avoids running vgchange where lvm is not set up at all, as it may
+ * then fail or take a long time; vgs lives next to vgchange
+ */
+static bool lvm_has_vgs() {
+    char vgs[256];
+    char const *sl = std::strrchr(VGCHANGE_PATH, '/');
+    std::snprintf(
+        vgs, sizeof(vgs), "%.*svgs",
+        sl ? int(sl - VGCHANGE_PATH + 1) : 0, VGCHANGE_PATH
+    );
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        /* cannot tell, so try anyway */
+        return true;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return true;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        execl(vgs, vgs, "--noheadings", "-o", "vg_name", nullptr);
+        _exit(127);
+    }
+    close(fds[1]);
+    bool found = false;
+    for (;;) {
+        char buf[256];
+        auto n = read(fds[0], buf, sizeof(buf));
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < n; ++i) {
+            if (!std::isspace(static_cast<unsigned char>(buf[i]))) {
+                found = true;
+            }
+        }
+    }
+    close(fds[0]);
+    while ((waitpid(pid, nullptr, 0) < 0) && (errno == EINTR)) {}
+    return found;
+}
+
+/* swap and network filesystems are independent of each other, local
+ * filesystems need both gone and are synced before anything is unmounted
+ * or made read-only, and the rest is strictly ordered; everything
+ * is run directly by absolute path, the helpers for swap and mounts and
+ * the external tools only for device teardown
+ */
+static stage const stages[STAGE_COUNT] = {
+    {
+        "swap", "Disabling swap...",
+        {HELPER("swap"), "shutdown", nullptr},
+        90, {-1}, true, false, false, nullptr
+    },
+    {
+        "netfs", "Unmounting network filesystems...",
+        {HELPER("mnt"), "umount-all", "nfs,nfs4,smbfs,cifs", "lazy", nullptr},
+        30, {-1}, true, false, false, nullptr
+    },
+    {
+        "netdev", nullptr,
+        {
+            HELPER("mnt"), "umount-all", "nonfs,nonfs4,nosmbfs,nocifs",
+            "lazy,netdev", nullptr
+        },
+        30, {STAGE_NETFS, -1}, true, false, false, nullptr
+    },
+    {
+        "sync", nullptr,
+        {HELPER("mnt"), "syncall", "50", nullptr},
+        60, {STAGE_SWAP, STAGE_NETDEV}, false, false, false, nullptr
+    },
+    {
+        "fs", "Unmounting filesystems...",
+        {
+            HELPER("mnt"), "umount-all", "nosysfs,noproc,nodevtmpfs,notmpfs",
+            nullptr
+        },
+        90, {STAGE_SYNC, -1}, true, false, false, nullptr
+    },
+    {
+        "root-ro", "Remounting root read-only...",
+        {HELPER("mnt"), "rmnt", "/", "ro", nullptr},
+        30, {STAGE_FS, -1}, true, false, false, nullptr
+    },
+    {
+        "cryptdisks", "Deactivating cryptdisks...",
+        {CRYPTDISKS_PATH, "remaining", "stop", nullptr},
+        30, {STAGE_ROOT, -1}, true, true, true, nullptr
+    },
+    {
+        "lvm", "Deactivating volume groups...",
+        {VGCHANGE_PATH, "-an", nullptr},
+        30, {STAGE_CRYPT, -1}, true, true, true, lvm_has_vgs
+    },
+    {
+        "cryptdisks-early", "Deactivating remaining cryptdisks...",
+        {CRYPTDISKS_PATH, "early", "stop", nullptr},
+        30, {STAGE_LVM, -1}, true, true, true, nullptr
+    },
+};
+
+static stage_state states[STAGE_COUNT];
+
+static double ms_since(struct timespec const &ts) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return double(now.tv_sec - ts.tv_sec) * 1000.0 +
+        double(now.tv_nsec - ts.tv_nsec) / 1000000.0;
+}
+
+static bool stage_ready(stage const &st) {
+    for (int i = 0; (i < MAX_DEPS) && (st.deps[i] >= 0); ++i) {
+        if (!states[st.deps[i]].done) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void stage_start(stage const &st, stage_state &ss) {
+    if (st.optional && access(st.argv[0], X_OK)) {
+        /* not installed, reported as skipped */
+        ss.done = true;
+        return;
+    }
+    ss.started = true;
+    clock_gettime(CLOCK_MONOTONIC, &ss.start);
+    if (st.msg) {
+        printf("%s\n", st.msg);
+    }
+    ss.pid = fork();
+    if (ss.pid < 0) {
+        warn("fork failed for stage '%s'", st.name);
+        ss.done = true;
+        ss.status = -1;
+        return;
+    }
+    if (ss.pid > 0) {
+        return;
+    }
+    /* own process group, so that timing out kills everything it ran */
+    setpgid(0, 0);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, nullptr);
+    if (st.no_udev) {
+        setenv("DM_DISABLE_UDEV", "1", 1);
+    }
+    if (st.pre && !st.pre()) {
+        _exit(0);
+    }
+    execv(st.argv[0], const_cast<char **>(st.argv));
+    warn("could not execute '%s'", st.argv[0]);
+    _exit(127);
+}
+
+static void stage_finish(stage_state &ss, int status) {
+    ss.done = true;
+    ss.status = status;
+    ss.ms = ms_since(ss.start);
+}
+
+static void report(double total) {
+    char buf[2048];
+    std::size_t len = 0;
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        auto &st = stages[i];
+        auto &ss = states[i];
+        char const *res;
+        if (!ss.started) {
+            res = "skipped";
+        } else if (ss.timed_out) {
+            res = "timed out";
+        } else if (
+            (ss.status < 0) || !WIFEXITED(ss.status) || WEXITSTATUS(ss.status)
+        ) {
+            res = "failed";
+        } else {
+            res = "ok";
+        }
+        int n = snprintf(
+            buf + len, sizeof(buf) - len, "shutdown: %-16s %9.1f ms  %s\n",
+            st.name, ss.ms, res
+        );
+        if ((n < 0) || (std::size_t(n) >= (sizeof(buf) - len))) {
+            break;
+        }
+        len += n;
+    }
+    int n = snprintf(
+        buf + len, sizeof(buf) - len, "shutdown: %-16s %9.1f ms\n",
+        "total", total
+    );
+    if ((n > 0) && (std::size_t(n) < (sizeof(buf) - len))) {
+        len += n;
+    }
+    fwrite(buf, 1, len, stdout);
+    fflush(stdout);
+    /* the pstore message device survives a reboot where available */
+    int fd = open("/dev/pmsg0", O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (write(fd, buf, len) < 0) {
+            warn("could not write to pstore");
+        }
+        close(fd);
+    }
+}
+
+int main(int, char **) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool container = !access("/run/dinit/container", F_OK);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        if (container && stages[i].host_only) {
+            states[i].done = true;
+        }
+    }
+    for (;;) {
+        bool running = false;
+        for (int i = 0; i < STAGE_COUNT; ++i) {
+            auto &ss = states[i];
+            if (!ss.done && !ss.started && stage_ready(stages[i])) {
+                stage_start(stages[i], ss);
+            }
+        }
+        /* nearest deadline */
+        double wait_ms = -1;
+        for (int i = 0; i < STAGE_COUNT; ++i) {
+            auto &ss = states[i];
+            if (!ss.started || ss.done) {
+                continue;
+            }
+            running = true;
+            double left = stages[i].timeout * 1000.0 - ms_since(ss.start);
+            if ((wait_ms < 0) || (left < wait_ms)) {
+                wait_ms = (left < 0) ? 0 : left;
+            }
+        }
+        if (!running) {
+            break;
+        }
+        struct timespec ts;
+        ts.tv_sec = time_t(wait_ms / 1000);
+        ts.tv_nsec = long((wait_ms - ts.tv_sec * 1000.0) * 1000000.0);
+        sigtimedwait(&mask, nullptr, &ts);
+        for (;;) {
+            int status;
+            pid_t pid = waitpid(-1, &status, WNOHANG);
+            if (pid <= 0) {
+                break;
+            }
+            for (auto &ss: states) {
+                if (ss.started && !ss.done && (ss.pid == pid)) {
+                    stage_finish(ss, status);
+                    break;
+                }
+            }
+        }
+        /* abandon whatever is over its deadline */
+        for (int i = 0; i < STAGE_COUNT; ++i) {
+            auto &ss = states[i];
+            if (!ss.started || ss.done) {
+                continue;
+            }
+            if (ms_since(ss.start) >= (stages[i].timeout * 1000.0)) {
+                warnx("stage '%s' timed out, moving on", stages[i].name);
+                kill(-ss.pid, SIGKILL);
+                ss.timed_out = true;
+                stage_finish(ss, -1);
+            }
+        }
+    }
+    report(ms_since(start));
+    return 0;
+}
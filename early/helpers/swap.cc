@@ -37,11 +37,30 @@
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
 #include <err.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <mntent.h>
+#include <sys/random.h>
 #include <sys/swap.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+
+#include "conf_common.hh"
+
+#ifndef HELPER_PATH
+#error "HELPER_PATH must be defined"
+#endif
 
 #ifndef SWAP_FLAG_DISCARD_ONCE
 #define SWAP_FLAG_DISCARD_ONCE 0x20000
@@ -51,7 +70,7 @@
 #endif
 
 static int usage(char **argv) {
-    fprintf(stderr, "usage: %s start|stop\n", argv[0]);
+    fprintf(stderr, "usage: %s start|stop|shutdown\n", argv[0]);
     return 1;
 }
 
@@ -83,21 +102,350 @@ static char const *resolve_dev(char const *raw, char *buf, size_t bufsz) {
     return raw;
 }
 
+/* in kilobytes */
+static unsigned long meminfo(char const *key) {
+    unsigned long ret = 0;
+    std::size_t klen = strlen(key);
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (!f) {
+        return 0;
+    }
+    char buf[256];
+    while (fgets(buf, sizeof(buf), f)) {
+        if (!strncmp(buf, key, klen) && (buf[klen] == ':')) {
+            ret = strtoul(buf + klen + 1, nullptr, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+/* compressed swap in ram; each line of a zram.d file sets up a device:
+ *
+ * zram0 size=50% algorithm=zstd priority=100 writeback=/dev/sdX discard
+ *
+ * the size is either a percentage of total memory or a byte count with
+ * an optional K, M or G suffix; everything but the size is optional, see
+ * the README for the details
+ */
+static char const *zram_paths[] = {
+    "/etc/zram.d",
+    "/run/zram.d",
+    "/usr/local/lib/zram.d",
+    "/usr/lib/zram.d",
+    nullptr
+};
+
+struct zram_dev {
+    std::string name;
+    std::string algo;
+    std::string writeback;
+    unsigned long long size = 0;
+    int flags = 0;
+};
+
+static bool zram_size(std::string_view val, unsigned long long &out) {
+    char buf[32];
+    if (val.empty() || (val.size() >= sizeof(buf))) {
+        return false;
+    }
+    std::memcpy(buf, val.data(), val.size());
+    buf[val.size()] = '\0';
+    char *end = nullptr;
+    unsigned long long num = strtoull(buf, &end, 10);
+    if (end == buf) {
+        return false;
+    }
+    switch (*end) {
+        case '%':
+            out = (num * meminfo("MemTotal") / 100) * 1024;
+            ++end;
+            break;
+        case 'G': num *= 1024; [[fallthrough]];
+        case 'M': num *= 1024; [[fallthrough]];
+        case 'K': num *= 1024; ++end; [[fallthrough]];
+        default:
+            out = num;
+            break;
+    }
+    return !*end && out;
+}
+
+static bool zram_parse(std::string_view line, zram_dev &dev) {
+    bool first = true;
+    while (!line.empty()) {
+        auto sp = line.find_first_of(" \t");
+        auto tok = line.substr(0, sp);
+        line = (sp == std::string_view::npos) ? "" : line.substr(sp + 1);
+        if (tok.empty()) {
+            continue;
+        }
+        if (first) {
+            if (
+                tok.compare(0, 4, "zram") || (tok.size() == 4) ||
+                (tok.find_first_not_of("0123456789", 4) != std::string_view::npos)
+            ) {
+                warnx("zram: invalid device name '%.*s'", int(tok.size()), tok.data());
+                return false;
+            }
+            dev.name = tok;
+            first = false;
+            continue;
+        }
+        auto eq = tok.find('=');
+        auto key = tok.substr(0, eq);
+        auto val = (eq == std::string_view::npos) ? "" : tok.substr(eq + 1);
+        if (key == "size") {
+            if (!zram_size(val, dev.size)) {
+                warnx("zram: invalid size for '%s'", dev.name.data());
+                return false;
+            }
+        } else if (key == "algorithm") {
+            dev.algo = val;
+        } else if (key == "writeback") {
+            dev.writeback = val;
+        } else if (key == "priority") {
+            char *end = nullptr;
+            std::string pv{val};
+            unsigned long pval = strtoul(pv.data(), &end, 10);
+            if (pv.empty() || *end) {
+                warnx("zram: invalid priority for '%s'", dev.name.data());
+                return false;
+            }
+            if (pval > SWAP_FLAG_PRIO_MASK) {
+                pval = SWAP_FLAG_PRIO_MASK;
+            }
+            dev.flags |= SWAP_FLAG_PREFER | pval;
+        } else if (key == "discard") {
+            dev.flags |= SWAP_FLAG_DISCARD;
+        } else {
+            warnx(
+                "zram: unknown option '%.*s' for '%s'",
+                int(key.size()), key.data(), dev.name.data()
+            );
+            return false;
+        }
+    }
+    if (!dev.size) {
+        warnx("zram: no size given for '%s'", dev.name.data());
+        return false;
+    }
+    return true;
+}
+
+static bool zram_write(char const *name, char const *attr, char const *val) {
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/block/%s/%s", name, attr);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        warn("zram: could not open '%s'", path);
+        return false;
+    }
+    std::size_t len = strlen(val);
+    if (write(fd, val, len) != ssize_t(len)) {
+        warn("zram: could not write '%s' to '%s'", val, path);
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+/* hot-add devices until the requested one exists */
+static bool zram_ensure(char const *name) {
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/block/%s", name);
+    if (!access(path, F_OK)) {
+        return true;
+    }
+    unsigned long want = strtoul(name + 4, nullptr, 10);
+    for (;;) {
+        char buf[32];
+        int fd = open("/sys/class/zram-control/hot_add", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            warn("zram: could not open zram-control");
+            return false;
+        }
+        auto n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n <= 0) {
+            warn("zram: could not add device");
+            return false;
+        }
+        buf[n] = '\0';
+        auto got = strtoul(buf, nullptr, 10);
+        if (got == want) {
+            return true;
+        } else if (got > want) {
+            warnx("zram: could not add device '%s'", name);
+            return false;
+        }
+    }
+}
+
+/* write a swap header like mkswap would */
+static bool zram_mkswap(char const *dev, unsigned long long size) {
+    long pgsize = sysconf(_SC_PAGESIZE);
+    unsigned long long npages = size / pgsize;
+    if (npages < 10) {
+        warnx("zram: '%s' is too small for swap", dev);
+        return false;
+    }
+    std::vector<unsigned char> page(pgsize, 0);
+    /* the info block follows the 1024 bytes of boot bits */
+    std::uint32_t info[3] = {
+        1, std::uint32_t(std::min(npages - 1, 0xFFFFFFFFULL)), 0
+    };
+    std::memcpy(&page[1024], info, sizeof(info));
+    unsigned char *uuid = &page[1024 + sizeof(info)];
+    if (getrandom(uuid, 16, 0) == 16) {
+        uuid[6] = (uuid[6] & 0x0F) | 0x40;
+        uuid[8] = (uuid[8] & 0x3F) | 0x80;
+    }
+    std::memcpy(&page[pgsize - 10], "SWAPSPACE2", 10);
+    int fd = open(dev, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        warn("zram: could not open '%s'", dev);
+        return false;
+    }
+    if ((pwrite(fd, page.data(), pgsize, 0) != pgsize) || fsync(fd)) {
+        warn("zram: could not write swap header to '%s'", dev);
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+static int zram_setup(zram_dev const &dev) {
+    char devp[64], val[32];
+    char const *name = dev.name.data();
+    snprintf(devp, sizeof(devp), "/dev/%s", name);
+    if (!zram_ensure(name)) {
+        return 1;
+    }
+    /* already set up, e.g. when started again */
+    snprintf(val, sizeof(val), "/sys/block/%s/disksize", name);
+    FILE *f = fopen(val, "r");
+    if (f) {
+        unsigned long long dsize = 0;
+        bool used = (fscanf(f, "%llu", &dsize) == 1) && dsize;
+        fclose(f);
+        if (used) {
+            warnx("zram: '%s' is already initialized", devp);
+            return 0;
+        }
+    }
+    /* these all have to be set before the size */
+    if (!dev.algo.empty() && !zram_write(name, "comp_algorithm", dev.algo.data())) {
+        return 1;
+    }
+    if (
+        !dev.writeback.empty() &&
+        !zram_write(name, "backing_dev", dev.writeback.data())
+    ) {
+        return 1;
+    }
+    snprintf(val, sizeof(val), "%llu", dev.size);
+    if (!zram_write(name, "disksize", val) || !zram_mkswap(devp, dev.size)) {
+        return 1;
+    }
+    if (swapon(devp, dev.flags)) {
+        warn("swapon failed for '%s'", devp);
+        return 1;
+    }
+    printf("activated zram swap '%s' (%llu MiB)\n", devp, dev.size >> 20);
+    return 0;
+}
+
+static int do_zram(void) {
+    std::vector<conf_file> files;
+    int ret = 0;
+    conf_collect(zram_paths, files);
+    if (files.empty()) {
+        return 0;
+    }
+    /* the module may not be loaded yet; done through our own kmod helper,
+     * which respects the kernel command line blacklist like everything else
+     */
+    if (access("/sys/class/zram-control", F_OK)) {
+        auto cpid = fork();
+        if (cpid == 0) {
+            execl(HELPER_PATH "/kmod", "kmod", "load", "zram", nullptr);
+            warn("zram: could not execute '%s'", HELPER_PATH "/kmod");
+            _exit(127);
+        } else if (cpid > 0) {
+            while ((waitpid(cpid, nullptr, 0) < 0) && (errno == EINTR)) {}
+        }
+    }
+    for (auto &cf: files) {
+        conf_reader rd;
+        if (!rd.open(cf.path.data())) {
+            warn("zram: could not open '%s'", cf.path.data());
+            ret = 1;
+            continue;
+        }
+        for (std::string_view line; rd.next(line);) {
+            zram_dev dev;
+            if (!zram_parse(line, dev) || zram_setup(dev)) {
+                ret = 1;
+            }
+        }
+    }
+    return ret;
+}
+
+struct swap_ent {
+    std::string name;
+    std::string dev;
+    int flags;
+    int ret;
+};
+
+static double ms_since(struct timespec const &ts) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return double(now.tv_sec - ts.tv_sec) * 1000.0 +
+        double(now.tv_nsec - ts.tv_nsec) / 1000000.0;
+}
+
+static int swap_activate(swap_ent const &ent) {
+    struct stat st;
+    struct timespec ts;
+    if (stat(ent.dev.data(), &st)) {
+        warn("stat failed for '%s'", ent.name.data());
+        return 1;
+    }
+    if (S_ISREG(st.st_mode) && ((st.st_blocks * (off_t)512) < st.st_size)) {
+        warnx("swap '%s' has holes", ent.name.data());
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    /* with discard, the whole device is trimmed in here */
+    if (swapon(ent.dev.data(), ent.flags)) {
+        warn("swapon failed for '%s'", ent.name.data());
+        return 1;
+    }
+    printf("activated swap '%s' (%.1f ms)\n", ent.name.data(), ms_since(ts));
+    return 0;
+}
+
 static int do_start(void) {
     struct mntent *m;
     int ret = 0;
     char devbuf[4096];
-    char const *devname;
+    std::vector<swap_ent> ents;
+    ret = do_zram();
     FILE *f = setmntent("/etc/fstab", "r");
     if (!f) {
         if (errno == ENOENT) {
-            return 0;
+            return ret;
         }
         err(1, "fopen");
     }
     while ((m = getmntent(f))) {
         char *opt;
-        struct stat st;
         int flags = 0;
         if (strcmp(m->mnt_type, "swap")) {
             continue;
@@ -133,31 +481,72 @@ static int do_start(void) {
                 }
             }
         }
-        devname = resolve_dev(m->mnt_fsname, devbuf, sizeof(devbuf));
-        if (stat(devname, &st)) {
-            warn("stat failed for '%s'", m->mnt_fsname);
-            ret = 1;
-            continue;
-        }
-        if (S_ISREG(st.st_mode) && ((st.st_blocks * (off_t)512) < st.st_size)) {
-            warnx("swap '%s' has holes", m->mnt_fsname);
-            ret = 1;
-            continue;
-        }
-        if (swapon(devname, flags)) {
-            warn("swapon failed for '%s'", m->mnt_fsname);
-            ret = 1;
-            continue;
-        }
+        ents.push_back(swap_ent{
+            m->mnt_fsname,
+            resolve_dev(m->mnt_fsname, devbuf, sizeof(devbuf)),
+            flags, 0
+        });
     }
     endmntent(f);
+    /* activate everything concurrently, so that slow swapons (such as
+     * with discard on large devices) overlap; explicit priorities do not
+     * depend on the order, and the decreasing ones the kernel gives to
+     * swaps without pri= follow the order in which they finish, which
+     * only decides which of them fills up first and is not worth waiting
+     * for; the zram devices are set up before this, as they must exist
+     */
+    std::vector<std::thread> thrs;
+    thrs.reserve(ents.size());
+    for (auto &ent: ents) {
+        thrs.emplace_back([&ent]() {
+            ent.ret = swap_activate(ent);
+        });
+    }
+    for (auto &thr: thrs) {
+        thr.join();
+    }
+    for (auto &ent: ents) {
+        ret |= ent.ret;
+    }
     return ret;
 }
 
-static int do_stop(void) {
+struct swap_used {
+    std::string path;
+    /* in kilobytes */
+    unsigned long used;
+};
+
+/* when shutting down, the contents of swap are never needed again, so
+ * only swaps that hold something up need to be disabled: files keep their
+ * filesystem busy, while device-mapper, md and loop devices are torn down
+ * after this; plain disks and partitions can be left alone
+ */
+static bool swap_needs_off(char const *path) {
+    struct stat st;
+    char buf[256];
+    if (stat(path, &st) || !S_ISBLK(st.st_mode)) {
+        return true;
+    }
+    for (char const *sub: {"dm", "md", "loop"}) {
+        snprintf(
+            buf, sizeof(buf), "/sys/dev/block/%u:%u/%s",
+            major(st.st_rdev), minor(st.st_rdev), sub
+        );
+        if (!access(buf, F_OK)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int do_stop(bool shutdown) {
     int ret = 0;
     char devbuf[4096];
     char const *devname;
+    std::vector<swap_used> swaps;
+    /* progress should show up as it happens */
+    setvbuf(stdout, nullptr, _IOLBF, 0);
     /* first do /proc/swaps */
     FILE *f = fopen("/proc/swaps", "r");
     if (f) {
@@ -168,18 +557,75 @@ static int do_stop(void) {
             if (*line != '/') {
                 continue;
             }
+            unsigned long size = 0, used = 0;
             char *p = strchr(line, ' ');
             if (p) {
-                *p = '\0';
+                *p++ = '\0';
+                /* type size used priority */
+                sscanf(p, "%*s %lu %lu", &size, &used);
             }
-            if (do_swapoff(line)) {
-                warn("swapoff failed for swap '%s'", line);
-                ret = 1;
+            /* same as in do_swapoff */
+            if (!strncmp(line, "/dev/zram", sizeof("/dev/zram") - 1)) {
+                continue;
+            }
+            if (shutdown && !swap_needs_off(line)) {
+                printf("leaving swap '%s' enabled\n", line);
+                continue;
             }
+            swaps.push_back(swap_used{line, used});
         }
         free(line);
         fclose(f);
     }
+    /* the least used ones go first as they are quickest to finish; swaps
+     * are disabled in parallel as long as everything paged back in so far
+     * fits in the memory that was available, serially otherwise
+     */
+    std::sort(swaps.begin(), swaps.end(), [](auto &a, auto &b) {
+        return a.used < b.used;
+    });
+    unsigned long budget = meminfo("MemAvailable") / 10 * 9;
+    unsigned long committed = 0;
+    std::size_t running = 0, ndone = 0;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<std::thread> thrs;
+    for (auto &sw: swaps) {
+        std::unique_lock<std::mutex> lk{mtx};
+        cv.wait(lk, [&]() {
+            return !running || ((committed + sw.used) <= budget);
+        });
+        committed += sw.used;
+        ++running;
+        lk.unlock();
+        printf(
+            "disabling swap '%s' (%lu MiB in use)...\n",
+            sw.path.data(), sw.used / 1024
+        );
+        thrs.emplace_back([&, nswaps = swaps.size()]() {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            int r = swapoff(sw.path.data());
+            if (r) {
+                warn("swapoff failed for swap '%s'", sw.path.data());
+            }
+            double ms = ms_since(ts);
+            std::lock_guard<std::mutex> glk{mtx};
+            if (r) {
+                ret = 1;
+            } else {
+                printf(
+                    "disabled swap '%s' (%.1f ms) [%zu/%zu]\n",
+                    sw.path.data(), ms, ++ndone, nswaps
+                );
+            }
+            --running;
+            cv.notify_all();
+        });
+    }
+    for (auto &thr: thrs) {
+        thr.join();
+    }
     /* then do fstab */
     f = setmntent("/etc/fstab", "r");
     if (f) {
@@ -189,6 +635,9 @@ static int do_stop(void) {
                 continue;
             }
             devname = resolve_dev(m->mnt_fsname, devbuf, sizeof(devbuf));
+            if (shutdown && !swap_needs_off(devname)) {
+                continue;
+            }
             if (do_swapoff(devname) && (errno != EINVAL)) {
                 warn("swapoff failed for '%s'", m->mnt_fsname);
                 ret = 1;
@@ -208,7 +657,9 @@ int main(int argc, char **argv) {
     if (!strcmp(argv[1], "start")) {
         return do_start();
     } else if (!strcmp(argv[1], "stop")) {
-        return do_stop();
+        return do_stop(false);
+    } else if (!strcmp(argv[1], "shutdown")) {
+        return do_stop(true);
     }
 
     return usage(argv);
@@ -4,6 +4,10 @@
  * This utility reads sysctl configuration files in the right order,
  * ensuring the behavior of procps's `sysctl --system`.
  *
+ * The configuration is first compiled into a plan, with globs expanded
+ * and later assignments overriding earlier ones, and only then applied,
+ * so that every sysctl is written at most once.
+ *
  * SPDX-License-Identifier: BSD-2-Clause
  *
  * Copyright (c) 2023 q66 <q66@chimera-linux.org>
@@ -30,7 +34,9 @@
  * SUCH DAMAGE.
  */
 
+#include <cctype>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <cerrno>
 #include <vector>
@@ -40,15 +46,22 @@
 #include <algorithm>
 
 #include <err.h>
-#include <glob.h>
+#include <fnmatch.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include "conf_common.hh"
+#include "trace_common.hh"
+
 /* /proc/sys */
 static int sysctl_fd = -1;
 static bool dry_run = false;
+/* compare with the current value before writing */
+static bool only_changed = false;
+static std::size_t num_applied = 0;
+static std::size_t num_unchanged = 0;
 
 /* search paths for conf files */
 static char const *paths[] = {
@@ -60,21 +73,129 @@ static char const *paths[] = {
 };
 static char const *sys_path = "/etc/sysctl.conf";
 
+struct sysctl_entry {
+    std::string name;
+    std::string value;
+    bool opt;
+};
+
+struct sysctl_plan {
+    /* in order of last assignment; overridden slots have an empty name */
+    std::vector<sysctl_entry> list;
+    /* name to its current slot in the list */
+    std::unordered_map<std::string, std::size_t> slots;
+    /* for tracking of glob exclusions */
+    std::unordered_set<std::string> entries;
+
+    void add(char const *name, char const *value, bool opt) {
+        auto it = slots.find(name);
+        if (it != slots.end()) {
+            /* last writer wins, and gets written where it was last set */
+            list[it->second].name.clear();
+            it->second = list.size();
+        } else {
+            slots.emplace(name, list.size());
+        }
+        list.push_back(sysctl_entry{name, value, opt});
+    }
+};
+
+struct sysctl_dirent {
+    std::string name;
+    unsigned char type;
+};
+
+/* directory listings under /proc/sys, relative path to sorted entries;
+ * these are shared by all the globs within a single run so that each
+ * directory is only ever read once
+ */
+static std::unordered_map<
+    std::string, std::vector<sysctl_dirent>
+> dir_cache;
+
+static std::vector<sysctl_dirent> const &list_dir(std::string const &path) {
+    auto it = dir_cache.find(path);
+    if (it != dir_cache.end()) {
+        return it->second;
+    }
+    auto &ents = dir_cache[path];
+    int dfd = openat(
+        sysctl_fd, path.empty() ? "." : path.data(), O_RDONLY | O_DIRECTORY
+    );
+    if (dfd < 0) {
+        if ((errno != ENOENT) && (errno != ENOTDIR)) {
+            warn("failed to open sysctl directory '%s'", path.data());
+        }
+        return ents;
+    }
+    if (!conf_scandir(dfd, [dfd, &ents](char const *dn, unsigned char dt) {
+        if (dt == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dfd, dn, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                return;
+            }
+            dt = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+        }
+        ents.push_back(sysctl_dirent{dn, dt});
+    })) {
+        warn("failed to read sysctl directory '%s'", path.data());
+    }
+    close(dfd);
+    /* match the ordering glob() would give us */
+    std::sort(ents.begin(), ents.end(), [](auto &a, auto &b) {
+        return (a.name < b.name);
+    });
+    return ents;
+}
+
+/* match the pattern one path component at a time against the cached
+ * listings, collecting regular files relative to /proc/sys
+ */
+static void glob_sysctl(
+    char const *pat, std::string &path, std::vector<std::string> &matches
+) {
+    auto clen = std::strcspn(pat, "/");
+    bool last = !pat[clen];
+    std::string comp{pat, clen};
+    auto plen = path.size();
+    for (auto &de: list_dir(path)) {
+        if (fnmatch(comp.data(), de.name.data(), FNM_PERIOD)) {
+            continue;
+        }
+        if (last) {
+            /* skip dirs if we match them */
+            if (de.type == DT_REG) {
+                matches.push_back(path + de.name);
+            }
+            continue;
+        } else if (de.type != DT_DIR) {
+            continue;
+        }
+        path += de.name;
+        path.push_back('/');
+        glob_sysctl(pat + clen + 1, path, matches);
+        path.resize(plen);
+    }
+}
+
 static void usage(FILE *f) {
     extern char const *__progname;
-    std::fprintf(f, "Usage: %s\n"
+    std::fprintf(f, "Usage: %s [--dry-run] [--only-changed] [--netif IFNAME]\n"
 "\n"
-"Load sysctl settings.\n",
+"Load sysctl settings.\n"
+"\n"
+"      --dry-run       Print the compiled settings instead of applying them.\n"
+"      --only-changed  Skip settings whose value is already in effect.\n"
+"      --netif IFNAME  Only handle settings specific to the given network\n"
+"                      interface, e.g. for one that appeared after boot.\n",
         __progname
     );
 }
 
 static bool load_sysctl(
-    char *name, char *value, bool opt, bool globbed,
-    std::unordered_set<std::string> &entries
+    char *name, char *value, bool opt, bool globbed, sysctl_plan &plan
 ) {
     size_t fsep;
-    std::string fullpath;
     /* we jump here so don't bypass var init */
     if (globbed) {
         goto doneg;
@@ -114,45 +235,26 @@ donep:
         if (dry_run) {
             fprintf(stderr, "potential glob: %s\n", name);
         }
-        fullpath = "/proc/sys/";
-        fullpath += name;
-        glob_t pglob;
-        int gret = glob(fullpath.data(), 0, nullptr, &pglob);
-        switch (gret) {
-            case 0:
-                if (dry_run) {
-                    fprintf(stderr, "... matches: %zu\n", pglob.gl_pathc);
-                }
-                break;
-            case GLOB_NOMATCH:
-                if (dry_run) {
-                    fprintf(stderr, "... no matches\n");
-                }
-                return true;
-            default:
-                warn("failed to glob '%s'", name);
-                return false;
+        std::vector<std::string> matches;
+        std::string gpath;
+        glob_sysctl(name, gpath, matches);
+        if (dry_run) {
+            if (matches.empty()) {
+                fprintf(stderr, "... no matches\n");
+            } else {
+                fprintf(stderr, "... matches: %zu\n", matches.size());
+            }
         }
         bool ret = true;
-        struct stat st;
-        for (char **paths = pglob.gl_pathv; *paths; ++paths) {
-            char *subp = *paths + sizeof("/proc/sys");
+        for (auto &subp: matches) {
             if (dry_run) {
-                fprintf(stderr, "... glob match: %s\n", subp);
+                fprintf(stderr, "... glob match: %s\n", subp.data());
             }
-            if (entries.find(subp) != entries.end()) {
+            if (plan.entries.find(subp) != plan.entries.end()) {
                 /* skip stuff with an explicit pattern */
                 continue;
             }
-            if (stat(*paths, &st)) {
-                warn("failed to stat '%s'", *paths);
-                ret = false;
-            }
-            if (!S_ISREG(st.st_mode)) {
-                /* skip dirs if we match them */
-                continue;
-            }
-            if (!load_sysctl(subp, value, opt, true, entries)) {
+            if (!load_sysctl(subp.data(), value, opt, true, plan)) {
                 ret = false;
             }
         }
@@ -164,7 +266,7 @@ doneg:
         if (dry_run) {
             fprintf(stderr,  "track sysctl: %s\n", name);
         }
-        entries.emplace(name);
+        plan.entries.emplace(name);
     }
     /* no value provided; this was prefixed and can be used to skip globs,
      * unprefixed versions would have already failed earlier due to checks
@@ -175,6 +277,104 @@ doneg:
         }
         return true;
     }
+    plan.add(name, value, opt);
+    return true;
+}
+
+/* parse an integer the way the kernel's proc handlers do, i.e. with
+ * automatic base detection and an optional sign
+ */
+static bool parse_num(
+    char const *s, std::size_t len, unsigned long long &v, bool &neg
+) {
+    char buf[32];
+    neg = false;
+    if (len && ((*s == '-') || (*s == '+'))) {
+        neg = (*s == '-');
+        ++s;
+        --len;
+    }
+    if (!len || (len >= sizeof(buf)) || !std::isdigit(*s)) {
+        return false;
+    }
+    std::memcpy(buf, s, len);
+    buf[len] = '\0';
+    char *end = nullptr;
+    errno = 0;
+    v = std::strtoull(buf, &end, 0);
+    if (errno || *end) {
+        return false;
+    }
+    if (!v) {
+        /* don't distinguish -0 and 0 */
+        neg = false;
+    }
+    return true;
+}
+
+static bool token_eq(
+    char const *a, std::size_t alen, char const *b, std::size_t blen
+) {
+    if ((alen == blen) && !std::memcmp(a, b, alen)) {
+        return true;
+    }
+    unsigned long long av, bv;
+    bool aneg, bneg;
+    if (!parse_num(a, alen, av, aneg) || !parse_num(b, blen, bv, bneg)) {
+        return false;
+    }
+    return (av == bv) && (aneg == bneg);
+}
+
+/* compare two values as sequences of whitespace separated tokens */
+static bool value_eq(char const *a, char const *b) {
+    for (;;) {
+        while (std::isspace(*a)) {
+            ++a;
+        }
+        while (std::isspace(*b)) {
+            ++b;
+        }
+        if (!*a || !*b) {
+            return (!*a && !*b);
+        }
+        auto alen = std::strcspn(a, " \t\n");
+        auto blen = std::strcspn(b, " \t\n");
+        if (!token_eq(a, alen, b, blen)) {
+            return false;
+        }
+        a += alen;
+        b += blen;
+    }
+}
+
+static bool sysctl_unchanged(char const *name, char const *value) {
+    char buf[4096];
+    int fd = openat(sysctl_fd, name, O_RDONLY);
+    if (fd < 0) {
+        /* e.g. write-only sysctl, can't tell */
+        return false;
+    }
+    auto rd = read(fd, buf, sizeof(buf));
+    close(fd);
+    if ((rd < 0) || (std::size_t(rd) >= sizeof(buf))) {
+        /* failed or possibly truncated, just write */
+        return false;
+    }
+    buf[rd] = '\0';
+    return value_eq(buf, value);
+}
+
+static bool apply_sysctl(sysctl_entry &ent) {
+    char const *name = ent.name.data();
+    bool opt = ent.opt;
+    if (only_changed && sysctl_unchanged(name, ent.value.data())) {
+        if (dry_run) {
+            fprintf(stderr, "unchanged sysctl: %s\n", name);
+        }
+        ++num_unchanged;
+        return true;
+    }
     int fd = openat(sysctl_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (fd < 0) {
         if (dry_run) {
@@ -190,14 +390,8 @@ doneg:
         }
         /* unknown entries */
         if (errno == ENOENT) {
-            for (;;) {
-                char *sl = std::strchr(name, '/');
-                if (!sl) {
-                    break;
-                }
-                *sl = '.';
-            }
-            warnx("unknown sysctl '%s'", name);
+            std::replace(ent.name.begin(), ent.name.end(), '/', '.');
+            warnx("unknown sysctl '%s'", ent.name.data());
             return false;
         }
         /* other error */
@@ -205,41 +399,79 @@ doneg:
         return false;
     }
     if (dry_run) {
-        fprintf(stderr, "setting sysctl: %s=%s (opt: %d)\n", name, value, opt);
+        fprintf(
+            stderr, "setting sysctl: %s=%s (opt: %d)\n",
+            name, ent.value.data(), opt
+        );
         close(fd);
         return true;
     }
     bool ret = true;
-    auto vlen = std::strlen(value);
-    value[vlen] = '\n';
+    ent.value.push_back('\n');
     errno = 0;
-    if ((write(fd, value, vlen + 1) <= 0) && !opt) {
-        warn("failed to set sysctl '%s'", name);
-        ret = false;
+    if (write(fd, ent.value.data(), ent.value.size()) <= 0) {
+        if (!opt) {
+            warn("failed to set sysctl '%s'", name);
+            ret = false;
+        }
+    } else {
+        ++num_applied;
     }
     close(fd);
     return ret;
 }
 
-static bool load_conf(
-    char const *s, char *&line, std::size_t &len,
-    std::unordered_set<std::string> &entries
-) {
-    FILE *f = std::fopen(s, "rb");
-    if (!f) {
-        warnx("could not load '%s'", s);
+/* whether the sysctl belongs to the given network interface, i.e. it is
+ * one of net/<proto>/<conf|neigh>/<ifname>/...
+ */
+static bool netif_match(std::string const &name, char const *ifname) {
+    if (name.compare(0, 4, "net/")) {
         return false;
     }
-    bool fret = true;
-    for (ssize_t nread; (nread = getline(&line, &len, f)) != -1;) {
-        /* strip leading whitespace and ignore comments, empty lines etc */
-        char *cline = line;
-        while (std::isspace(*cline)) {
-            ++cline;
-        }
-        if ((*cline == '#') || (*cline == ';') || !*cline) {
+    /* skip the protocol and the table */
+    auto sp = name.find('/', 4);
+    if (sp != std::string::npos) {
+        sp = name.find('/', sp + 1);
+    }
+    if (sp == std::string::npos) {
+        return false;
+    }
+    auto ep = name.find('/', ++sp);
+    if (ep == std::string::npos) {
+        return false;
+    }
+    return !name.compare(sp, ep - sp, ifname);
+}
+
+/* print the plan in a form that can be read back as sysctl.conf */
+static void print_plan(sysctl_plan &plan) {
+    for (auto &ent: plan.list) {
+        if (ent.name.empty()) {
             continue;
         }
+        std::string dname = ent.name;
+        for (auto &c: dname) {
+            switch (c) {
+                case '.': c = '/'; break;
+                case '/': c = '.'; break;
+                default: break;
+            }
+        }
+        std::printf(
+            "%s%s = %s\n", ent.opt ? "-" : "", dname.data(), ent.value.data()
+        );
+    }
+}
+
+static bool load_conf(char const *s, sysctl_plan &plan) {
+    conf_reader rd;
+    if (!rd.open(s)) {
+        warnx("could not load '%s'", s);
+        return false;
+    }
+    bool fret = true;
+    /* the line is modified in place during parsing */
+    for (char *cline; rd.next(cline);) {
         /* sysctls starting with - should not fail ever */
         bool opt = (*cline == '-');
         if (opt) {
@@ -250,11 +482,6 @@ static bool load_conf(
         while (std::isspace(*cline)) {
             ++cline;
         }
-        /* strip trailing whitespace too once we are sure it's not empty */
-        auto rl = std::strlen(line);
-        while (std::isspace(line[rl - 1])) {
-            line[--rl] = '\0';
-        }
         if (dry_run) {
             fprintf(stderr, "=> LINE MATCH: '%s'\n", cline);
         }
@@ -286,18 +513,35 @@ static bool load_conf(
             ++svalue;
         }
         /* load the sysctl */
-        if (!load_sysctl(sname, svalue, opt, false, entries)) {
+        if (!load_sysctl(sname, svalue, opt, false, plan)) {
             fret = false;
         }
     }
-    std::fclose(f);
     return fret;
 }
 
-int main(int argc, char **) {
-    if (argc != 1) {
-        usage(stderr);
-        return 1;
+int main(int argc, char **argv) {
+    bool print_only = false;
+    char const *netif = nullptr;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--dry-run")) {
+            print_only = true;
+        } else if (!std::strcmp(argv[i], "--only-changed")) {
+            only_changed = true;
+        } else if (!std::strcmp(argv[i], "--netif") && (i + 1 < argc)) {
+            netif = argv[++i];
+        } else {
+            usage(stderr);
+            return 1;
+        }
+    }
+
+    if (netif && (
+        !*netif || std::strchr(netif, '/') ||
+        !std::strcmp(netif, ".") || !std::strcmp(netif, "..")
+    )) {
+        errx(1, "invalid interface name '%s'", netif);
     }
 
     sysctl_fd = open("/proc/sys", O_DIRECTORY | O_PATH);
@@ -308,86 +552,60 @@ int main(int argc, char **) {
     /* prints stuff but does not actually set anything */
     dry_run = !!getenv("DINIT_CHIMERA_SYSCTL_DRY_RUN");
 
-    std::unordered_map<std::string, std::string> got_map;
+    std::vector<conf_file> files;
 
-    for (char const **p = paths; *p; ++p) {
-        int dfd = open(*p, O_RDONLY | O_DIRECTORY);
-        if (dfd < 0) {
-            continue;
-        }
-        int dupfd = dup(dfd);
-        if (dupfd < 0) {
-            err(1, "dupfd");
-        }
-        DIR *dirp = fdopendir(dupfd);
-        if (!dirp) {
-            err(1, "fdopendir");
-        }
-        struct dirent *dp;
-        while ((dp = readdir(dirp))) {
-            /* must be a regular file or a symlink to regular file; we cannot
-             * use d_type (nonportable anyway) because that will get DT_LNK
-             * for symlinks (it does not follow)
-             */
-            struct stat st;
-            if ((fstatat(dfd, dp->d_name, &st, 0) < 0) || !S_ISREG(st.st_mode)) {
-                continue;
-            }
-            /* check if it matches .conf */
-            char const *dn = dp->d_name;
-            auto sl = std::strlen(dn);
-            if ((sl <= 5) || strcmp(dn + sl - 5, ".conf")) {
-                continue;
-            }
-            /* check if already in map */
-            if (got_map.find(dn) != got_map.end()) {
-                continue;
-            }
-            /* otherwise use its full name */
-            std::string fp = *p;
-            fp.push_back('/');
-            fp += dp->d_name;
-            got_map.emplace(dn, std::move(fp));
-        }
-        close(dfd);
-        closedir(dirp);
-    }
-
-    std::vector<std::string const *> ord_list;
-
-    /* construct a sorted vector of names, backed by map memory */
-    for (auto &p: got_map) {
-        ord_list.push_back(&p.first);
-    }
-
-    std::sort(ord_list.begin(), ord_list.end(), [](auto a, auto b) {
-        return (*a < *b);
-    });
+    conf_collect(paths, files);
 
     int ret = 0;
 
-    /* now register or print each conf */
-    char *line = nullptr;
-    std::size_t len = 0;
-    /* for tracking of glob exclusions */
-    std::unordered_set<std::string> entries;
+    /* first compile each conf into the plan */
+    sysctl_plan plan;
 
-    for (auto &c: ord_list) {
-        if (!load_conf(got_map[*c].data(), line, len, entries)) {
+    trace_event("compile");
+    for (auto &c: files) {
+        if (!load_conf(c.path.data(), plan)) {
             ret = 1;
         }
     }
-    /* global sysctl.conf is last if it exists */
+    /* global sysctl.conf is last if it exists; it is always loaded, as
+     * it is not a part of the sysctl.d namespace and cannot be masked
+     */
     if (!access(sys_path, R_OK)) {
-        char const *asysp = strchr(sys_path, '/') + 1;
-        /* only load if no file called sysctl.conf was already handled */
-        if (got_map.find(asysp) == got_map.end()) {
-            if (!load_conf(sys_path, line, len, entries)) {
+        if (!load_conf(sys_path, plan)) {
+            ret = 1;
+        }
+    }
+
+    /* only keep what concerns the interface if requested */
+    if (netif) {
+        for (auto &ent: plan.list) {
+            if (!ent.name.empty() && !netif_match(ent.name, netif)) {
+                ent.name.clear();
+            }
+        }
+    }
+
+    /* then apply it, or just print it */
+    trace_event("apply");
+    if (print_only) {
+        print_plan(plan);
+    } else {
+        for (auto &ent: plan.list) {
+            if (ent.name.empty()) {
+                continue;
+            }
+            if (!apply_sysctl(ent)) {
                 ret = 1;
             }
         }
+        if (only_changed) {
+            std::printf(
+                "sysctl: %zu applied, %zu unchanged\n",
+                num_applied, num_unchanged
+            );
+        }
     }
-    std::free(line);
+
     close(sysctl_fd);
     return ret;
 }
@@ -0,0 +1,273 @@
+/*
+ * Boot timeline tracing helper
+ *
+ * Wraps early services to record their start and exit, records arbitrary
+ * events, and prints the recorded timeline or a critical-path view of it.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 q66 <q66@chimera-linux.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <err.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "trace_common.hh"
+
+static pid_t child_pid = 0;
+
+static void usage(FILE *f) {
+    extern char const *__progname;
+    std::fprintf(f, "Usage: %s command [arg]...\n"
+"\n"
+"Record and inspect the boot timeline.\n"
+"\n"
+"Commands:\n"
+"  run NAME CMD [ARG]...      Run a command as service NAME, recording\n"
+"                             its start and exit.\n"
+"  record NAME PHASE [STATUS] Record a single event.\n"
+"  show                       Print all recorded events.\n"
+"  analyze                    Print service durations and the chain of\n"
+"                             services that determined the boot time.\n",
+        __progname
+    );
+}
+
+static void forward_sig(int sig) {
+    if (child_pid > 0) {
+        kill(child_pid, sig);
+    }
+}
+
+static int do_run(char const *name, char **argv) {
+    if (!trace_enabled()) {
+        execvp(argv[0], argv);
+        err(127, "could not execute '%s'", argv[0]);
+    }
+    /* the child and everything it runs records under this name */
+    setenv(TRACE_SERVICE_ENV, name, 1);
+    trace_event_as(name, "start", 0, getpid());
+    /* dinit signals us, so pass that on */
+    struct sigaction sa{};
+    sa.sa_handler = forward_sig;
+    sigemptyset(&sa.sa_mask);
+    for (int sig: {SIGTERM, SIGINT, SIGHUP, SIGQUIT, SIGUSR1, SIGUSR2}) {
+        sigaction(sig, &sa, nullptr);
+    }
+    child_pid = fork();
+    if (child_pid < 0) {
+        err(1, "fork failed");
+    } else if (child_pid == 0) {
+        sa.sa_handler = SIG_DFL;
+        for (int sig: {SIGTERM, SIGINT, SIGHUP, SIGQUIT, SIGUSR1, SIGUSR2}) {
+            sigaction(sig, &sa, nullptr);
+        }
+        execvp(argv[0], argv);
+        warn("could not execute '%s'", argv[0]);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(child_pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            err(1, "waitpid failed");
+        }
+    }
+    int ret = WIFEXITED(status) ? WEXITSTATUS(status) : (128 + WTERMSIG(status));
+    trace_event_as(name, "exit", ret, getpid());
+    return ret;
+}
+
+static double ms(std::uint64_t ns) {
+    return double(ns) / 1000000.0;
+}
+
+static int do_show() {
+    std::vector<trace_rec> recs;
+    if (!trace_read(recs)) {
+        errx(1, "no boot trace available");
+    }
+    /* each phase lasts until the next event of the same service; this is
+     * keyed by name rather than pid, as start and exit are recorded by the
+     * wrapper while the helper phases come from the child it runs
+     */
+    std::vector<double> dur(recs.size(), -1);
+    std::unordered_map<std::string_view, std::uint64_t> next;
+    for (std::size_t i = recs.size(); i-- > 0;) {
+        auto &r = recs[i];
+        std::string_view name{r.name, strnlen(r.name, sizeof(r.name))};
+        auto it = next.find(name);
+        if ((it != next.end()) && (it->second >= r.mono_ns)) {
+            dur[i] = ms(it->second - r.mono_ns);
+        }
+        next[name] = r.mono_ns;
+    }
+    for (std::size_t i = 0; i < recs.size(); ++i) {
+        auto &r = recs[i];
+        std::printf(
+            "%10.3f ms  %-24.*s %-24.*s", ms(r.boot_ns),
+            int(sizeof(r.name)), r.name, int(sizeof(r.phase)), r.phase
+        );
+        if (dur[i] >= 0) {
+            std::printf(" (%.3f ms)", dur[i]);
+        }
+        if (r.status) {
+            std::printf(" status %d", r.status);
+        }
+        std::printf("\n");
+    }
+    return 0;
+}
+
+struct svc_span {
+    std::string name;
+    std::uint64_t start;
+    std::uint64_t end;
+    int status;
+    bool done;
+};
+
+static int do_analyze() {
+    std::vector<trace_rec> recs;
+    if (!trace_read(recs)) {
+        errx(1, "no boot trace available");
+    }
+    std::vector<svc_span> spans;
+    std::unordered_map<std::int32_t, std::size_t> bypid;
+    for (auto &r: recs) {
+        if (!std::strcmp(r.phase, "start")) {
+            bypid[r.pid] = spans.size();
+            spans.push_back(svc_span{r.name, r.boot_ns, r.boot_ns, 0, false});
+        } else if (!std::strcmp(r.phase, "exit")) {
+            auto it = bypid.find(r.pid);
+            if (it != bypid.end()) {
+                auto &sp = spans[it->second];
+                sp.end = r.boot_ns;
+                sp.status = r.status;
+                sp.done = true;
+                bypid.erase(it);
+            }
+        }
+    }
+    if (spans.empty()) {
+        errx(1, "no services in the boot trace");
+    }
+    std::printf("services by duration:\n");
+    std::vector<svc_span const *> bydur;
+    for (auto &sp: spans) {
+        bydur.push_back(&sp);
+    }
+    std::sort(bydur.begin(), bydur.end(), [](auto *a, auto *b) {
+        return (a->end - a->start) > (b->end - b->start);
+    });
+    for (auto *sp: bydur) {
+        if (!sp->done) {
+            std::printf("  %10s     %s (still running)\n", "", sp->name.data());
+            continue;
+        }
+        std::printf(
+            "  %10.3f ms  %s", ms(sp->end - sp->start), sp->name.data()
+        );
+        if (sp->status) {
+            std::printf(" (status %d)", sp->status);
+        }
+        std::printf("\n");
+    }
+    /* walk back from the service that finished last, each time to the
+     * service that finished last before the current one started, which
+     * is the one most likely to have been holding it up
+     */
+    svc_span const *cur = nullptr;
+    for (auto &sp: spans) {
+        if (sp.done && (!cur || (sp.end > cur->end))) {
+            cur = &sp;
+        }
+    }
+    std::vector<svc_span const *> chain;
+    while (cur) {
+        chain.push_back(cur);
+        svc_span const *prev = nullptr;
+        for (auto &sp: spans) {
+            if (
+                sp.done && (&sp != cur) && (sp.end <= cur->start) &&
+                (!prev || (sp.end > prev->end))
+            ) {
+                prev = &sp;
+            }
+        }
+        cur = prev;
+    }
+    std::printf("\ncritical chain:\n");
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        auto *sp = *it;
+        std::printf(
+            "  @%10.3f ms  +%10.3f ms  %s\n",
+            ms(sp->start), ms(sp->end - sp->start), sp->name.data()
+        );
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage(stderr);
+        return 1;
+    }
+    if (!std::strcmp(argv[1], "run")) {
+        if (argc < 4) {
+            errx(1, "incorrect number of arguments");
+        }
+        return do_run(argv[2], &argv[3]);
+    } else if (!std::strcmp(argv[1], "record")) {
+        if ((argc < 4) || (argc > 5)) {
+            errx(1, "incorrect number of arguments");
+        }
+        int status = (argc > 4) ? std::atoi(argv[4]) : 0;
+        trace_event_as(argv[2], argv[3], status, getppid());
+        return 0;
+    } else if (!std::strcmp(argv[1], "show")) {
+        return do_show();
+    } else if (!std::strcmp(argv[1], "analyze")) {
+        return do_analyze();
+    } else if (!std::strcmp(argv[1], "help")) {
+        usage(stdout);
+        return 0;
+    }
+    usage(stderr);
+    return 1;
+}
@@ -0,0 +1,156 @@
+/*
+ * Boot timeline tracing for the helpers
+ *
+ * The ring is a small header followed by a fixed number of records. The
+ * writers reserve a slot with an atomic increment of the header counter,
+ * so no locking is needed between processes.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 q66 <q66@chimera-linux.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace_common.hh"
+
+static constexpr std::uint32_t TRACE_MAGIC = 0x43525444;
+static constexpr std::uint32_t TRACE_VERSION = 1;
+static constexpr std::uint32_t TRACE_NRECS = 1024;
+
+struct trace_hdr {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t nrecs;
+    std::uint32_t head;
+};
+
+static constexpr std::size_t trace_size =
+    sizeof(trace_hdr) + TRACE_NRECS * sizeof(trace_rec);
+
+static trace_hdr *trace_map(bool write) {
+    int fd = open(
+        TRACE_PATH, (write ? (O_RDWR | O_CREAT) : O_RDONLY) | O_CLOEXEC, 0644
+    );
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (
+        fstat(fd, &st) ||
+        ((std::size_t(st.st_size) < trace_size) &&
+         (!write || ftruncate(fd, trace_size)))
+    ) {
+        close(fd);
+        return nullptr;
+    }
+    void *p = mmap(
+        nullptr, trace_size, PROT_READ | (write ? PROT_WRITE : 0),
+        MAP_SHARED, fd, 0
+    );
+    close(fd);
+    if (p == MAP_FAILED) {
+        return nullptr;
+    }
+    auto *hdr = static_cast<trace_hdr *>(p);
+    if (write) {
+        /* whoever comes first, the values are the same */
+        hdr->magic = TRACE_MAGIC;
+        hdr->version = TRACE_VERSION;
+        hdr->nrecs = TRACE_NRECS;
+    } else if ((hdr->magic != TRACE_MAGIC) || (hdr->version != TRACE_VERSION)) {
+        munmap(p, trace_size);
+        return nullptr;
+    }
+    return hdr;
+}
+
+static trace_rec *trace_recs(trace_hdr *hdr) {
+    return reinterpret_cast<trace_rec *>(hdr + 1);
+}
+
+bool trace_enabled() {
+    return !!std::getenv(TRACE_ENV);
+}
+
+void trace_event_as(char const *name, char const *phase, int status, pid_t pid) {
+    /* mapped once per process and kept around */
+    static trace_hdr *hdr = nullptr;
+    if (!trace_enabled()) {
+        return;
+    }
+    if (!hdr && !(hdr = trace_map(true))) {
+        return;
+    }
+    auto idx = __atomic_fetch_add(&hdr->head, 1, __ATOMIC_RELAXED);
+    auto &rec = trace_recs(hdr)[idx % TRACE_NRECS];
+    __atomic_store_n(&rec.seq, 0, __ATOMIC_RELAXED);
+    struct timespec mono, boot;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    rec.pid = pid;
+    rec.status = status;
+    rec.mono_ns = std::uint64_t(mono.tv_sec) * 1000000000 + mono.tv_nsec;
+    rec.boot_ns = std::uint64_t(boot.tv_sec) * 1000000000 + boot.tv_nsec;
+    std::memset(rec.name, 0, sizeof(rec.name));
+    std::memset(rec.phase, 0, sizeof(rec.phase));
+    std::strncpy(rec.name, name, sizeof(rec.name) - 1);
+    std::strncpy(rec.phase, phase, sizeof(rec.phase) - 1);
+    __atomic_store_n(&rec.seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+void trace_event(char const *phase, int status) {
+    extern char const *__progname;
+    if (!trace_enabled()) {
+        return;
+    }
+    char const *name = std::getenv(TRACE_SERVICE_ENV);
+    trace_event_as(name ? name : __progname, phase, status, getpid());
+}
+
+bool trace_read(std::vector<trace_rec> &recs) {
+    auto *hdr = trace_map(false);
+    if (!hdr) {
+        return false;
+    }
+    auto *rp = trace_recs(hdr);
+    for (std::uint32_t i = 0; i < TRACE_NRECS; ++i) {
+        if (__atomic_load_n(&rp[i].seq, __ATOMIC_ACQUIRE)) {
+            recs.push_back(rp[i]);
+        }
+    }
+    munmap(hdr, trace_size);
+    std::sort(recs.begin(), recs.end(), [](auto &a, auto &b) {
+        return a.seq < b.seq;
+    });
+    return true;
+}
@@ -0,0 +1,75 @@
+/*
+ * Boot timeline tracing for the helpers
+ *
+ * Fixed-size records in a preallocated ring under /run/dinit, shared by
+ * all processes of the boot; enabled with dinit_early_trace=1.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 q66 <q66@chimera-linux.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef TRACE_COMMON_H
+#define TRACE_COMMON_H
+
+#include <cstdint>
+#include <vector>
+
+#include <sys/types.h>
+
+#define TRACE_PATH "/run/dinit/boot-trace"
+/* set in the activation environment when tracing is requested */
+#define TRACE_ENV "DINIT_EARLY_TRACE"
+/* the service the current process runs on behalf of */
+#define TRACE_SERVICE_ENV "DINIT_TRACE_SERVICE"
+
+struct trace_rec {
+    /* position in the ring plus one, written last; zero when invalid */
+    std::uint32_t seq;
+    std::int32_t pid;
+    std::int32_t status;
+    std::uint32_t pad;
+    std::uint64_t mono_ns;
+    std::uint64_t boot_ns;
+    char name[32];
+    char phase[32];
+};
+
+static_assert(sizeof(trace_rec) == 96, "trace records must be fixed-size");
+
+/* whether tracing was requested for this boot */
+bool trace_enabled();
+
+/* record that the current service enters the given phase, which lasts
+ * until its next event; does nothing when disabled and never fails
+ */
+void trace_event(char const *phase, int status = 0);
+
+/* the same with an explicit service name and pid */
+void trace_event_as(char const *name, char const *phase, int status, pid_t pid);
+
+/* read all valid records in order; false if there is no trace */
+bool trace_read(std::vector<trace_rec> &recs);
+
+#endif
@@ -22,4 +22,10 @@ fi
 
 [ -z "$DINIT_CONTAINER" -o -z "$DINIT_NO_CONTAINER" ] || exit 0
 
+# if requested, run the service again under the boot tracer, which
+# records its start and exit and whatever the helpers record in between
+if [ -n "$DINIT_EARLY_TRACE" -a -z "$DINIT_TRACE_SERVICE" ]; then
+    exec @HELPER_PATH@/trace run "$DINIT_SERVICE" "$0" "$@"
+fi
+
 log_debug "$DINIT_SERVICE"
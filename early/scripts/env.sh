@@ -18,6 +18,11 @@ if [ "$dinit_early_debug" ]; then
     fi
 fi
 
+# passed by the kernel, record a boot timeline
+if [ "$dinit_early_trace" ]; then
+    dinitctl --use-passed-cfd setenv "DINIT_EARLY_TRACE=1"
+fi
+
 # detect if running in a container, expose it globally
 if [ -n "${container+x}" ]; then
     dinitctl --use-passed-cfd setenv DINIT_CONTAINER=1
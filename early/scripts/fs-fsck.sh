@@ -10,8 +10,9 @@ command -v fsck > /dev/null 2>&1 || exit 0
 FORCEARG=
 FIXARG="-a"
 
-if [ -r /proc/cmdline ]; then
-    for x in $(cat /proc/cmdline); do
+# init arguments after -- count too, as they always have
+parse_cmdline() {
+    while read -r x; do
         case "$x" in
             fastboot|fsck.mode=skip)
                 echo "Skipping filesystem checks (fastboot)."
@@ -28,6 +29,15 @@ if [ -r /proc/cmdline ]; then
                 ;;
         esac
     done
+}
+
+# the cache may be missing if it could not be written
+if [ -r /run/dinit/cmdline ]; then
+    parse_cmdline < /run/dinit/cmdline
+else
+    parse_cmdline <<EOF
+$(@HELPER_PATH@/cmdline show)
+EOF
 fi
 
 fsck -A -R -C -t noopts=_netdev $FORCEARG $FIXARG
@@ -7,10 +7,10 @@ DINIT_NO_CONTAINER=1
 
 case "$1" in
     start)
-        exec mount -a -t "nosysfs,nonfs,nonfs4,nosmbfs,nocifs" -O no_netdev
+        exec @HELPER_PATH@/mnt fstab-start
         ;;
     stop)
-        exec umount -r -a -t nosysfs,noproc,nodevtmpfs,notmpfs
+        exec @HELPER_PATH@/mnt umount-all nosysfs,noproc,nodevtmpfs,notmpfs
         ;;
      *) exit 1 ;;
 esac
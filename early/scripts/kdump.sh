@@ -13,7 +13,7 @@ command -v makedumpfile > /dev/null 2>&1 || exit 0
 command -v vmcore-dmesg > /dev/null 2>&1 || exit 0
 command -v kexec > /dev/null 2>&1 || exit 0
 
-if [ -e /proc/vmcore ] && ! grep -q nokdump /proc/cmdline; then
+if [ -e /proc/vmcore ] && ! @HELPER_PATH@/cmdline get nokdump > /dev/null; then
     DUMP_DIR="/var/crash/kdump-$(date +%Y%m%d-%H%M%S)"
     # save vmcore
     echo "Saving vmcore to '$DUMP_DIR'..."
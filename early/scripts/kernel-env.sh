@@ -2,8 +2,9 @@
 #
 # Expose kernel environment in dinit
 #
-# Nothing to do here for now, as there is no way to tell what would
-# become environment variables.
+# Nothing to do here for the environment for now, as there is no way
+# to tell what would become environment variables; the command line
+# is parsed and cached for the other services though.
 
 DINIT_SERVICE=kernel-env
 # containers do not clear environment so no need, also not portable
@@ -11,6 +12,4 @@ DINIT_NO_CONTAINER=1
 
 . @SCRIPT_PATH@/common.sh
 
-set -e
-
-exit 0
+exec @HELPER_PATH@/cmdline cache
@@ -5,4 +5,4 @@ DINIT_NO_CONTAINER=1
 
 . @SCRIPT_PATH@/common.sh
 
-exec @HELPER_PATH@/kmod static-modules
+exec @HELPER_PATH@/kmod static-modules nodes
@@ -10,8 +10,9 @@ command -v fsck > /dev/null 2>&1 || exit 0
 FORCEARG=
 FIXARG="-a"
 
-if [ -r /proc/cmdline ]; then
-    for x in $(cat /proc/cmdline); do
+# init arguments after -- count too, as they always have
+parse_cmdline() {
+    while read -r x; do
         case "$x" in
             fastboot|fsck.mode=skip)
                 echo "Skipping root filesystem check (fastboot)."
@@ -28,13 +29,29 @@ if [ -r /proc/cmdline ]; then
                 ;;
         esac
     done
+}
+
+# the cache may be missing if it could not be written
+if [ -r /run/dinit/cmdline ]; then
+    parse_cmdline < /run/dinit/cmdline
+else
+    parse_cmdline <<EOF
+$(@HELPER_PATH@/cmdline show)
+EOF
 fi
 
-mntent() {
-    @HELPER_PATH@/mnt getent "$1" / "$2" 2>/dev/null
-}
+# all in one go, one line per query
+{
+    read -r ROOTFSPASS
+    read -r ROOTDEV
+    read -r ROOTFSTYPE
+} <<EOF
+$(@HELPER_PATH@/mnt query \
+    getent /etc/fstab / passno \
+    getent /proc/self/mounts / fsname \
+    getent /proc/self/mounts / type 2>/dev/null)
+EOF
 
-ROOTFSPASS=$(mntent /etc/fstab passno)
 # skipped; every other number is treated as that we do check
 # technically the pass number could be specified as bigger than
 # for other filesystems, but we don't support this configuration
@@ -43,11 +60,9 @@ if [ "$ROOTFSPASS" = "0" ]; then
     exit 0
 fi
 
-ROOTDEV=$(mntent /proc/self/mounts fsname)
 # e.g. zfs will not report a valid block device
 [ -n "$ROOTDEV" -a -b "$ROOTDEV" ] || exit 0
 
-ROOTFSTYPE=$(mntent /proc/self/mounts type)
 # ensure it's a known filesystem
 [ -n "$ROOTFSTYPE" ] || exit 0
 
@@ -4,4 +4,4 @@ DINIT_SERVICE=sysctl
 
 . @SCRIPT_PATH@/common.sh
 
-exec @HELPER_PATH@/sysctl
+exec @HELPER_PATH@/sysctl --only-changed
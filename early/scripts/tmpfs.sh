@@ -18,19 +18,10 @@ if [ -r /etc/initramfs-tools/initramfs.conf ]; then
     done
 fi
 
-# overrides via kernel cmdline
-if [ -r /proc/cmdline ]; then
-    for x in $(cat /proc/cmdline); do
-        case "$x" in
-            # initramfs-tools compat
-            initramfs.runsize=*)
-                RUNSIZE="${x#initramfs.runsize=}"
-                ;;
-            dinit.runsize=*)
-                RUNSIZE="${x#dinit.runsize=}"
-                ;;
-        esac
-    done
+# overrides via kernel cmdline, initramfs.runsize for initramfs-tools compat;
+# this runs before the parsed command line is cached in /run
+if CMDL_RUNSIZE=$(@HELPER_PATH@/cmdline get initramfs.runsize dinit.runsize); then
+    RUNSIZE="$CMDL_RUNSIZE"
 fi
 
 RUNSIZE="${RUNSIZE:-10%}"
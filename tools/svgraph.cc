@@ -0,0 +1,621 @@
+/*
+ * Service graph analyzer
+ *
+ * Parses the service files and reports the longest dependency chain,
+ * optionally weighted by recorded timings, along with dependency edges
+ * that serialize startup without any apparent need.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 q66 <q66@chimera-linux.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <err.h>
+#include <dirent.h>
+#include <unistd.h>
+
+/* targets after which persistent filesystems are available */
+static char const *fs_targets[] = {
+    "early-root-rw.target",
+    "early-fs-fstab.target",
+    "early-fs-local.target",
+};
+
+/* paths that are usable before any of the above */
+static char const *pseudo_paths[] = {
+    "/proc", "/sys", "/dev", "/run",
+};
+
+struct edge {
+    std::string to;
+    std::string kind;
+};
+
+struct service {
+    std::string type;
+    std::string command;
+    std::vector<edge> deps;
+    /* analysis state */
+    double weight = 0;
+    double finish = 0;
+    std::size_t crit = 0;
+    int state = 0;
+    int needs_fs = -1;
+};
+
+static std::vector<std::string> names;
+static std::vector<service> services;
+static std::unordered_map<std::string, std::size_t> byname;
+static std::unordered_map<std::string, double> timings;
+
+static void usage(FILE *f) {
+    extern char const *__progname;
+    std::fprintf(f, "Usage: %s [OPTION]... SERVICEDIR SCRIPTDIR HELPERDIR\n"
+"\n"
+"Analyze the dependency graph of the service files in SERVICEDIR.\n"
+"\n"
+"Prints the longest dependency chain and every dependency edge of a\n"
+"scripted service that waits for filesystems while the script (or the\n"
+"helpers it runs, both looked up in SCRIPTDIR and HELPERDIR) only uses\n"
+"pseudo-filesystem paths.\n"
+"\n"
+"Options:\n"
+"  -t FILE  weight the services with timings from FILE, one service\n"
+"           and its duration in milliseconds per line, or the output\n"
+"           of 'trace analyze'\n"
+"  -c       exit with a failure status if any edges were reported\n"
+"  -h       print this message and exit\n",
+        __progname
+    );
+}
+
+static std::string trim(std::string const &s) {
+    auto b = s.find_first_not_of(" \t\r\n");
+    if (b == std::string::npos) {
+        return std::string{};
+    }
+    auto e = s.find_last_not_of(" \t\r\n");
+    return s.substr(b, e - b + 1);
+}
+
+static std::size_t get_service(std::string const &name) {
+    auto it = byname.find(name);
+    if (it != byname.end()) {
+        return it->second;
+    }
+    byname.emplace(name, names.size());
+    names.push_back(name);
+    services.emplace_back();
+    return names.size() - 1;
+}
+
+static void add_dir_deps(
+    std::size_t idx, char const *path, char const *kind
+) {
+    /* only resolvable when analyzing an installed tree */
+    auto *dp = opendir(path);
+    if (!dp) {
+        return;
+    }
+    while (auto *dent = readdir(dp)) {
+        if (dent->d_name[0] == '.') {
+            continue;
+        }
+        services[idx].deps.push_back(edge{dent->d_name, kind});
+    }
+    closedir(dp);
+}
+
+static bool load_service(char const *dir, char const *name) {
+    std::string path = dir;
+    path += '/';
+    path += name;
+    auto *f = std::fopen(path.data(), "rb");
+    if (!f) {
+        warn("could not open '%s'", path.data());
+        return false;
+    }
+    auto idx = get_service(name);
+    char *line = nullptr;
+    std::size_t len = 0;
+    while (getline(&line, &len, f) > 0) {
+        std::string ln = line;
+        auto hash = ln.find('#');
+        if (hash != std::string::npos) {
+            ln.erase(hash);
+        }
+        auto sep = ln.find_first_of("=:");
+        if (sep == std::string::npos) {
+            continue;
+        }
+        auto key = trim(ln.substr(0, sep));
+        auto val = trim(ln.substr(sep + 1));
+        auto &sv = services[idx];
+        if (key == "type") {
+            sv.type = val;
+        } else if (key == "command") {
+            sv.command = val;
+        } else if (
+            (key == "depends-on") || (key == "depends-ms") ||
+            (key == "waits-for") || (key == "after")
+        ) {
+            sv.deps.push_back(edge{val, key});
+        } else if (key == "before") {
+            /* may be a forward reference, which invalidates sv */
+            auto oidx = get_service(val);
+            services[oidx].deps.push_back(edge{name, "before"});
+        } else if (key == "depends-on.d") {
+            add_dir_deps(idx, val.data(), "depends-on.d");
+        } else if (key == "waits-for.d") {
+            add_dir_deps(idx, val.data(), "waits-for.d");
+        }
+    }
+    std::free(line);
+    std::fclose(f);
+    return true;
+}
+
+static bool load_services(char const *dir) {
+    auto *dp = opendir(dir);
+    if (!dp) {
+        warn("could not open '%s'", dir);
+        return false;
+    }
+    std::vector<std::string> files;
+    while (auto *dent = readdir(dp)) {
+        std::string nm = dent->d_name;
+        if ((nm[0] == '.') || (nm == "meson.build")) {
+            continue;
+        }
+        if ((dent->d_type != DT_REG) && (dent->d_type != DT_UNKNOWN)) {
+            continue;
+        }
+        files.push_back(nm);
+    }
+    closedir(dp);
+    /* stable output regardless of directory order */
+    std::sort(files.begin(), files.end());
+    bool ret = true;
+    for (auto &nm: files) {
+        ret = load_service(dir, nm.data()) && ret;
+    }
+    return ret;
+}
+
+static bool load_timings(char const *path) {
+    auto *f = std::fopen(path, "rb");
+    if (!f) {
+        warn("could not open '%s'", path);
+        return false;
+    }
+    char *line = nullptr;
+    std::size_t len = 0;
+    while (getline(&line, &len, f) > 0) {
+        /* either "NAME MS", or "MS ms NAME" as printed by the tracer */
+        char name[256], unit[8];
+        double val;
+        if (
+            (std::sscanf(line, " %lf %7s %255s", &val, unit, name) == 3) &&
+            !std::strcmp(unit, "ms")
+        ) {
+            timings[name] = val;
+        } else if (std::sscanf(line, " %255s %lf", name, &val) == 2) {
+            timings[name] = val;
+        }
+    }
+    std::free(line);
+    std::fclose(f);
+    return true;
+}
+
+static bool find_timing(std::string const &name, double &val) {
+    auto it = timings.find(name);
+    /* the tracer records scripts under their name sans prefix */
+    if ((it == timings.end()) && !name.compare(0, 6, "early-")) {
+        it = timings.find(name.substr(6));
+    }
+    if (it == timings.end()) {
+        return false;
+    }
+    val = it->second;
+    return true;
+}
+
+static bool is_pseudo_path(std::string const &p) {
+    for (auto *pp: pseudo_paths) {
+        auto plen = std::strlen(pp);
+        if (
+            !p.compare(0, plen, pp) &&
+            ((p.size() == plen) || (p[plen] == '/'))
+        ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool read_file(std::string const &path, std::string &out) {
+    auto *f = std::fopen(path.data(), "rb");
+    if (!f) {
+        return false;
+    }
+    char buf[4096];
+    std::size_t n;
+    while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0) {
+        out.append(buf, n);
+    }
+    std::fclose(f);
+    return true;
+}
+
+static bool is_path_char(char c) {
+    auto uc = static_cast<unsigned char>(c);
+    return std::isalnum(uc) || (c && std::strchr("._/+-", c));
+}
+
+/* whether a helper reads configuration or its string literals refer
+ * to any real paths
+ */
+static bool helper_uses_fs(char const *helperdir, std::string const &name) {
+    std::string src;
+    if (!read_file(std::string{helperdir} + "/" + name + ".cc", src)) {
+        return true;
+    }
+    if (src.find("\"conf_common.hh\"") != std::string::npos) {
+        return true;
+    }
+    for (std::size_t i = 0; (i = src.find("\"/", i)) != std::string::npos;) {
+        auto e = ++i;
+        while ((e < src.size()) && is_path_char(src[e])) {
+            ++e;
+        }
+        auto p = src.substr(i, e - i);
+        if ((p.size() > 1) && !is_pseudo_path(p)) {
+            return true;
+        }
+        i = e;
+    }
+    return false;
+}
+
+/* whether a script may use persistent filesystems; this is a heuristic,
+ * as it cannot tell what external programs do, so a script only counts
+ * as not needing them when it positively uses pseudo-filesystem paths
+ * or helpers and nothing else, which works as the early scripts refer
+ * to every file they use by its absolute path
+ */
+static bool script_uses_fs(
+    char const *scriptdir, char const *helperdir, std::string const &name,
+    bool &evidence, int depth = 0
+) {
+    std::string src;
+    if (
+        name.empty() || (depth > 4) ||
+        !read_file(std::string{scriptdir} + "/" + name, src)
+    ) {
+        return true;
+    }
+    /* drop comment lines, including the interpreter line */
+    for (std::size_t i = 0; i < src.size();) {
+        auto b = src.find_first_not_of(" \t", i);
+        auto e = src.find('\n', i);
+        if (e == std::string::npos) {
+            e = src.size();
+        }
+        if ((b < e) && (src[b] == '#')) {
+            src.erase(i, e - i);
+        } else {
+            i = e + 1;
+        }
+    }
+    for (std::size_t i = 0; i < src.size(); ++i) {
+        /* configured paths, @HELPER_PATH@/name and so on */
+        if (src[i] == '@') {
+            auto e = src.find('@', i + 1);
+            if (e == std::string::npos) {
+                break;
+            }
+            auto subst = src.substr(i + 1, e - i - 1);
+            if (
+                subst.empty() ||
+                (subst.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZ_") !=
+                 std::string::npos)
+            ) {
+                /* not a substitution, e.g. "$@" */
+                continue;
+            }
+            auto pe = ++e;
+            while ((pe < src.size()) && is_path_char(src[pe])) {
+                ++pe;
+            }
+            auto p = src.substr(e, pe - e);
+            auto sname = p.substr(std::min(p.find_first_not_of('/'), p.size()));
+            i = pe - 1;
+            if (subst == "HELPER_PATH") {
+                if (helper_uses_fs(helperdir, sname)) {
+                    return true;
+                }
+                evidence = true;
+            } else if (subst == "SCRIPT_PATH") {
+                if (sname == "common.sh") {
+                    continue;
+                }
+                if (script_uses_fs(
+                    scriptdir, helperdir, sname, evidence, depth + 1
+                )) {
+                    return true;
+                }
+            } else {
+                return true;
+            }
+            continue;
+        }
+        /* only consider tokens that start with the slash */
+        if ((src[i] != '/') || ((i > 0) && is_path_char(src[i - 1]))) {
+            continue;
+        }
+        auto e = i + 1;
+        while ((e < src.size()) && is_path_char(src[e])) {
+            ++e;
+        }
+        auto p = src.substr(i, e - i);
+        i = e - 1;
+        if (p.size() <= 1) {
+            continue;
+        }
+        if (!is_pseudo_path(p)) {
+            return true;
+        }
+        evidence = true;
+    }
+    return false;
+}
+
+static bool service_uses_fs(
+    service const &sv, char const *scriptdir, char const *helperdir
+) {
+    auto cmd = sv.command.substr(0, sv.command.find_first_of(" \t"));
+    auto slash = cmd.rfind('/');
+    if (slash != std::string::npos) {
+        cmd.erase(0, slash + 1);
+    }
+    bool evidence = false;
+    if (script_uses_fs(scriptdir, helperdir, cmd, evidence)) {
+        return true;
+    }
+    return !evidence;
+}
+
+static bool is_fs_target(std::string const &name) {
+    for (auto *t: fs_targets) {
+        if (name == t) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool needs_fs(std::size_t idx) {
+    auto &sv = services[idx];
+    if (sv.needs_fs >= 0) {
+        return sv.needs_fs;
+    }
+    sv.needs_fs = is_fs_target(names[idx]);
+    for (std::size_t i = 0; !sv.needs_fs && (i < sv.deps.size()); ++i) {
+        /* unknown services were reported already */
+        auto it = byname.find(services[idx].deps[i].to);
+        if ((it != byname.end()) && needs_fs(it->second)) {
+            services[idx].needs_fs = 1;
+        }
+    }
+    return services[idx].needs_fs;
+}
+
+/* longest weighted path ending in the given service */
+static bool visit(std::size_t idx) {
+    auto &sv = services[idx];
+    if (sv.state == 2) {
+        return true;
+    } else if (sv.state == 1) {
+        warnx("dependency cycle through '%s'", names[idx].data());
+        return false;
+    }
+    sv.state = 1;
+    double best = 0;
+    std::size_t crit = idx;
+    for (std::size_t i = 0; i < services[idx].deps.size(); ++i) {
+        auto it = byname.find(services[idx].deps[i].to);
+        if (it == byname.end()) {
+            continue;
+        }
+        if (!visit(it->second)) {
+            return false;
+        }
+        if ((crit == idx) || (services[it->second].finish > best)) {
+            best = services[it->second].finish;
+            crit = it->second;
+        }
+    }
+    auto &svr = services[idx];
+    svr.finish = best + svr.weight;
+    svr.crit = crit;
+    svr.state = 2;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    char const *tfile = nullptr;
+    bool check = false;
+
+    for (int c; (c = getopt(argc, argv, "t:ch")) >= 0;) {
+        switch (c) {
+            case 't':
+                tfile = optarg;
+                break;
+            case 'c':
+                check = true;
+                break;
+            case 'h':
+                usage(stdout);
+                return 0;
+            default:
+                usage(stderr);
+                return 1;
+        }
+    }
+
+    if ((argc - optind) != 3) {
+        usage(stderr);
+        return 1;
+    }
+
+    char const *srvdir = argv[optind];
+    char const *scriptdir = argv[optind + 1];
+    char const *helperdir = argv[optind + 2];
+
+    if (!load_services(srvdir)) {
+        return 1;
+    }
+    if (tfile && !load_timings(tfile)) {
+        return 1;
+    }
+
+    int ret = 0;
+
+    /* services referenced but never defined, e.g. from before = */
+    std::vector<std::size_t> order;
+    for (std::size_t i = 0; i < names.size(); ++i) {
+        if (services[i].type.empty()) {
+            warnx("service '%s' is not defined", names[i].data());
+            ret = 1;
+            continue;
+        }
+        for (auto &dep: services[i].deps) {
+            if (!byname.count(dep.to)) {
+                warnx(
+                    "'%s' refers to unknown service '%s'",
+                    names[i].data(), dep.to.data()
+                );
+                ret = 1;
+            }
+        }
+        order.push_back(i);
+    }
+
+    /* without timings, count every service that runs something */
+    bool weighted = !timings.empty();
+    for (auto i: order) {
+        auto &sv = services[i];
+        if (!weighted) {
+            sv.weight = (sv.type == "internal") ? 0 : 1;
+        } else if (!find_timing(names[i], sv.weight)) {
+            sv.weight = 0;
+        }
+    }
+
+    std::size_t last = names.size();
+    for (auto i: order) {
+        if (!visit(i)) {
+            return 1;
+        }
+        if (
+            (last == names.size()) ||
+            (services[i].finish > services[last].finish)
+        ) {
+            last = i;
+        }
+    }
+
+    if (last != names.size()) {
+        std::vector<std::size_t> chain;
+        for (auto i = last;; i = services[i].crit) {
+            chain.push_back(i);
+            if (services[i].crit == i) {
+                break;
+            }
+        }
+        if (weighted) {
+            std::printf(
+                "critical chain (%.3f ms):\n", services[last].finish
+            );
+        } else {
+            std::printf(
+                "critical chain (%.0f services):\n", services[last].finish
+            );
+        }
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            auto &sv = services[*it];
+            if (weighted) {
+                std::printf(
+                    "  @%10.3f ms  +%10.3f ms  %s\n",
+                    sv.finish - sv.weight, sv.weight, names[*it].data()
+                );
+            } else {
+                std::printf("  %s\n", names[*it].data());
+            }
+        }
+    }
+
+    /* scripted services that only touch pseudo-filesystems yet wait
+     * for persistent filesystems are serialized for no reason
+     */
+    bool header = false;
+    for (auto i: order) {
+        auto &sv = services[i];
+        if (sv.type != "scripted") {
+            continue;
+        }
+        if (service_uses_fs(sv, scriptdir, helperdir)) {
+            continue;
+        }
+        for (auto &dep: sv.deps) {
+            auto it = byname.find(dep.to);
+            if ((it == byname.end()) || !needs_fs(it->second)) {
+                continue;
+            }
+            if (!header) {
+                std::printf("\nunneeded serialization on filesystems:\n");
+                header = true;
+            }
+            std::printf(
+                "  %s -> %s (%s)\n",
+                names[i].data(), dep.to.data(), dep.kind.data()
+            );
+            if (check) {
+                ret = 1;
+            }
+        }
+    }
+
+    return ret;
+}